@@ -0,0 +1,439 @@
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include <omp.h>
+
+#include "glm/glm.hpp"
+
+#include "bdpt.hpp"
+#include "buffer.hpp"
+#include "global.hpp"
+#include "material.hpp"
+#include "object.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+
+const int kMaxBDPTDepth = 10;
+const int kMaxBDPTVertices = kMaxBDPTDepth + 2;
+// Russian roulette starts once a subpath has this many vertices
+const int kBDPTRRVertices = 5;
+
+inline flt remap0(flt x)
+{
+    return x != 0 ? x : 1.0f;
+}
+
+inline bool is_emitter(const BDPTVertex& v)
+{
+    vec3 foo;
+    return v.type == BDPTVertex::LIGHT
+        || (v.type == BDPTVertex::SURFACE && v.rec.mat->type(foo) == Material::LIGHT);
+}
+
+// The normal on the side of w, all non-delta BSDFs here only reflect
+inline HitRecord oriented(const HitRecord& rec, const vec3& w)
+{
+    HitRecord r = rec;
+    if (glm::dot(r.normal, w) < 0)
+        r.normal = -r.normal;
+    return r;
+}
+
+// Solid angle pdf at from to area pdf at to
+inline flt convert_density(flt pdf, const BDPTVertex& from, const BDPTVertex& to)
+{
+    vec3 w = to.rec.p - from.rec.p;
+    flt dist2 = glm::dot(w, w);
+    if (dist2 == 0)
+        return 0.0f;
+    if (to.type != BDPTVertex::CAMERA)
+        pdf *= fabsf(glm::dot(to.rec.normal, w)) / sqrtf(dist2);
+    return pdf / dist2;
+}
+
+inline flt geometry(const BDPTVertex& a, const BDPTVertex& b)
+{
+    vec3 w = b.rec.p - a.rec.p;
+    flt dist2 = glm::dot(w, w);
+    if (dist2 == 0)
+        return 0.0f;
+    w /= sqrtf(dist2);
+    flt g = 1.0f / dist2;
+    if (a.type != BDPTVertex::CAMERA)
+        g *= fabsf(glm::dot(a.rec.normal, w));
+    if (b.type != BDPTVertex::CAMERA)
+        g *= fabsf(glm::dot(b.rec.normal, w));
+    return g;
+}
+
+inline bool is_black(const vec3& v)
+{
+    return v[0] == 0 && v[1] == 0 && v[2] == 0;
+}
+
+BDPT::BDPT()
+{
+}
+
+void BDPT::init(Scene& scene)
+{
+    lights.clear();
+    for (auto emi : scene.egroup.emissive_list) {
+        Triangle* tri = dynamic_cast<Triangle*>(emi);
+        if (tri)
+            lights.push_back(tri);
+    }
+    if (lights.empty())
+        ERRORM("bdpt needs emissive triangles\n");
+    if (lights.size() != scene.egroup.emissive_list.size())
+        INFO("bdpt ignores the lights that are not emissive triangles\n");
+
+    splats.assign(omp_get_max_threads(), Buffer(scene.buffer.width, scene.buffer.height));
+    for (auto& splat : splats)
+        splat.clear();
+}
+
+// Pick an emitter uniformly and a point uniformly on it
+void BDPT::sample_light(BDPTVertex& vertex)
+{
+    int n = lights.size();
+    int id = std::min(static_cast<int>(uniform() * n), n - 1);
+    Triangle* tri = lights[id];
+
+    vec3 Ke;
+    tri->mat->type(Ke);
+    flt pdf_pos = 1.0f / (n * tri->get_area());
+
+    vertex.type = BDPTVertex::LIGHT;
+    vertex.rec.p = tri->sample_point();
+    vertex.rec.normal = tri->normal;
+    vertex.rec.mat = tri->mat;
+    vertex.rec.obj = tri;
+    vertex.wo = vec3(0.0f);
+    vertex.beta = Ke / pdf_pos;
+    vertex.delta = false;
+    vertex.pdf_fwd = pdf_pos;
+    vertex.pdf_rev = 0.0f;
+}
+
+int BDPT::camera_subpath(Scene& scene, int x, int y, BDPTVertex* path)
+{
+    BDPTVertex& v = path[0];
+    v.type = BDPTVertex::CAMERA;
+    v.rec.p = scene.camera.position;
+    v.rec.normal = scene.camera.forward;
+    v.rec.mat = NULL;
+    v.rec.obj = NULL;
+    v.beta = vec3(1.0f);
+    v.delta = false;
+    v.pdf_fwd = 1.0f;
+    v.pdf_rev = 0.0f;
+
+    Ray ray = scene.camera.cast_ray(x, y);
+    return random_walk(scene, ray, vec3(1.0f), scene.camera.pdf_dir(ray.direction), true, path);
+}
+
+int BDPT::light_subpath(Scene& scene, BDPTVertex* path)
+{
+    if (lights.empty())
+        return 0;
+    sample_light(path[0]);
+
+    // Cosine weighted emission from the front face
+    flt phi = uniform(0, 2 * PI);
+    flt cos_theta = sqrtf(1.0f - uniform());
+    vec3 dir = to_world(angle_to_cartesian(cos_theta, phi), path[0].rec.normal);
+    flt pdf_dir = cos_theta / PI;
+    if (!(pdf_dir > 0))
+        return 1;
+
+    vec3 beta = path[0].beta * cos_theta / pdf_dir;
+    return random_walk(scene, Ray(path[0].rec.p, dir), beta, pdf_dir, false, path);
+}
+
+// Extend path[0] with a random walk, returns the number of vertices
+int BDPT::random_walk(Scene& scene, Ray ray, vec3 beta, flt pdf_fwd, bool from_camera, BDPTVertex* path)
+{
+    int n = 1;
+    flt pdf_rev = 0.0f;
+    HitRecord rec;
+    vec3 foo, wi;
+    while (n < kMaxBDPTVertices) {
+        if (!scene.bvh_root->hit(ray, vec2(kHitEps, INFINITY), rec))
+            break;
+
+        BDPTVertex& v = path[n];
+        BDPTVertex& prev = path[n - 1];
+        v.type = BDPTVertex::SURFACE;
+        v.rec = rec;
+        v.wo = -ray.direction;
+        v.beta = beta;
+        v.delta = false;
+        v.pdf_fwd = convert_density(pdf_fwd, prev, v);
+        v.pdf_rev = 0.0f;
+
+        // Emitters end the walk, light subpaths do not keep them
+        Material::material_type type = rec.mat->type(foo);
+        if (type == Material::LIGHT) {
+            if (from_camera)
+                n++;
+            break;
+        }
+        n++;
+
+        if (type == Material::GLASS) {
+            rec.mat->scatter(v.wo, rec, wi);
+            beta *= rec.mat->bsdf(v.wo, wi, rec);
+            v.delta = true;
+            pdf_fwd = pdf_rev = 0.0f;
+        } else {
+            HitRecord r = oriented(rec, v.wo);
+            pdf_fwd = rec.mat->scatter(v.wo, r, wi);
+            if (!(pdf_fwd > 0) || glm::dot(wi, r.normal) <= 0)
+                break;
+            beta *= rec.mat->bsdf(v.wo, wi, r) * glm::dot(wi, r.normal) / pdf_fwd;
+            pdf_rev = rec.mat->pdf(wi, r, v.wo);
+        }
+        prev.pdf_rev = convert_density(pdf_rev, v, prev);
+
+        if (n >= kBDPTRRVertices) {
+            flt q = std::min(1.0f, glm::compMax(beta) / glm::compMax(path[1].beta));
+            if (!(uniform() < q))
+                break;
+            beta /= q;
+        }
+        ray = Ray(rec.p, wi);
+    }
+    return n;
+}
+
+vec3 BDPT::f(const BDPTVertex& v, const vec3& next) const
+{
+    vec3 w = glm::normalize(next - v.rec.p);
+    // The emitted radiance is already part of beta
+    if (v.type == BDPTVertex::LIGHT)
+        return glm::dot(v.rec.normal, w) > 0 ? vec3(1.0f) : vec3(0.0f);
+    return v.rec.mat->bsdf(v.wo, w, oriented(v.rec, v.wo));
+}
+
+vec3 BDPT::Le(const BDPTVertex& v, const vec3& next) const
+{
+    vec3 Ke;
+    if (v.rec.mat->type(Ke) != Material::LIGHT || glm::dot(v.rec.normal, next - v.rec.p) <= 0)
+        return vec3(0.0f);
+    return Ke;
+}
+
+// Area pdf of v sampling next, prev is where v was reached from
+flt BDPT::pdf(Scene& scene, const BDPTVertex& v, const BDPTVertex* prev, const BDPTVertex& next) const
+{
+    if (v.type == BDPTVertex::LIGHT)
+        return pdf_light(v, next);
+
+    vec3 wn = next.rec.p - v.rec.p;
+    if (glm::dot(wn, wn) == 0)
+        return 0.0f;
+    wn = glm::normalize(wn);
+
+    flt pdf_dir;
+    if (v.type == BDPTVertex::CAMERA) {
+        pdf_dir = scene.camera.pdf_dir(wn);
+    } else {
+        vec3 wp = glm::normalize(prev->rec.p - v.rec.p);
+        pdf_dir = v.rec.mat->pdf(wp, oriented(v.rec, wp), wn);
+    }
+    return convert_density(pdf_dir, v, next);
+}
+
+// Area pdf of an emitter at v emitting towards next
+flt BDPT::pdf_light(const BDPTVertex& v, const BDPTVertex& next) const
+{
+    vec3 w = next.rec.p - v.rec.p;
+    flt dist2 = glm::dot(w, w);
+    if (dist2 == 0)
+        return 0.0f;
+    w /= sqrtf(dist2);
+    flt cos_theta = glm::dot(v.rec.normal, w);
+    if (cos_theta <= 0)
+        return 0.0f;
+
+    flt pdf = cos_theta / PI / dist2;
+    if (next.type != BDPTVertex::CAMERA)
+        pdf *= fabsf(glm::dot(next.rec.normal, w));
+    return pdf;
+}
+
+// Area pdf of sample_light choosing the point of v
+flt BDPT::pdf_light_origin(const BDPTVertex& v) const
+{
+    auto tri = dynamic_cast<const Triangle*>(v.rec.obj);
+    if (!tri || lights.empty())
+        return 0.0f;
+    return 1.0f / (lights.size() * tri->get_area());
+}
+
+bool BDPT::visible(Scene& scene, const vec3& a, const vec3& b) const
+{
+    HitRecord rec;
+    flt dist = glm::length(b - a);
+    return !scene.bvh_root->hit(Ray(a, b - a), vec2(kHitEps, dist - kHitEps), rec);
+}
+
+// Power heuristic weight of strategy (s, t) against all the strategies generating the same path.
+// sampled replaces light[0] when s == 1 and t > 1.
+flt BDPT::mis_weight(Scene& scene, const BDPTVertex* light, int s, const BDPTVertex* camera, int t, const BDPTVertex& sampled)
+{
+    flt cam_fwd[kMaxBDPTVertices], cam_rev[kMaxBDPTVertices];
+    flt light_fwd[kMaxBDPTVertices], light_rev[kMaxBDPTVertices];
+    bool cam_delta[kMaxBDPTVertices], light_delta[kMaxBDPTVertices];
+
+    for (int i = 0; i < t; i++) {
+        cam_fwd[i] = camera[i].pdf_fwd;
+        cam_rev[i] = camera[i].pdf_rev;
+        cam_delta[i] = camera[i].delta;
+    }
+    for (int i = 0; i < s; i++) {
+        const BDPTVertex& v = (s == 1 && t > 1) ? sampled : light[i];
+        light_fwd[i] = v.pdf_fwd;
+        light_rev[i] = v.pdf_rev;
+        light_delta[i] = v.delta;
+    }
+
+    // The connection endpoints are sampled from the other side too
+    const BDPTVertex& pt = camera[t - 1];
+    const BDPTVertex* qs = s == 0 ? NULL : (s == 1 && t > 1) ? &sampled : &light[s - 1];
+    const BDPTVertex* pt_minus = t > 1 ? &camera[t - 2] : NULL;
+    const BDPTVertex* qs_minus = s > 1 ? &light[s - 2] : NULL;
+
+    cam_delta[t - 1] = false;
+    cam_rev[t - 1] = qs ? pdf(scene, *qs, qs_minus, pt) : pdf_light_origin(pt);
+    if (pt_minus)
+        cam_rev[t - 2] = qs ? pdf(scene, pt, qs, *pt_minus) : pdf_light(pt, *pt_minus);
+    if (qs) {
+        light_delta[s - 1] = false;
+        light_rev[s - 1] = pdf(scene, pt, pt_minus, *qs);
+    }
+    if (qs_minus)
+        light_rev[s - 2] = pdf(scene, *qs, &pt, *qs_minus);
+
+    flt sum = 0.0f;
+    flt ri = 1.0f;
+    for (int i = t - 1; i > 0; i--) {
+        ri *= sq(remap0(cam_rev[i]) / remap0(cam_fwd[i]));
+        if (!cam_delta[i] && !cam_delta[i - 1])
+            sum += ri;
+    }
+    ri = 1.0f;
+    for (int i = s - 1; i >= 0; i--) {
+        ri *= sq(remap0(light_rev[i]) / remap0(light_fwd[i]));
+        bool delta_prev = i > 0 ? light_delta[i - 1] : false;
+        if (!light_delta[i] && !delta_prev)
+            sum += ri;
+    }
+    return 1.0f / (1.0f + sum);
+}
+
+// Unweighted contribution of strategy (s, t) times its MIS weight.
+// For t == 1 the contribution belongs to the returned pixel.
+vec3 BDPT::connect(Scene& scene, BDPTVertex* light, int s, BDPTVertex* camera, int t, ivec2& pixel)
+{
+    vec3 L(0.0f);
+    BDPTVertex sampled;
+    const BDPTVertex& pt = camera[t - 1];
+
+    if (s == 0) {
+        // The camera subpath hit an emitter
+        if (pt.type != BDPTVertex::SURFACE || !is_emitter(pt))
+            return L;
+        L = pt.beta * Le(pt, camera[t - 2].rec.p);
+    } else if (t == 1) {
+        // Light tracing, connect to the pinhole
+        const BDPTVertex& qs = light[s - 1];
+        if (qs.delta || !scene.camera.raster(qs.rec.p, pixel))
+            return L;
+        vec3 wc = scene.camera.position - qs.rec.p;
+        flt dist2 = glm::dot(wc, wc);
+        wc /= sqrtf(dist2);
+        flt We = scene.camera.importance(-wc);
+        flt cos_cam = glm::dot(-wc, scene.camera.forward);
+        L = qs.beta * f(qs, scene.camera.position) * fabsf(glm::dot(qs.rec.normal, wc)) * We * cos_cam / dist2;
+        if (!is_black(L) && !visible(scene, qs.rec.p, scene.camera.position))
+            L = vec3(0.0f);
+    } else if (s == 1) {
+        // Next event estimation with a new light sample
+        if (pt.delta || is_emitter(pt))
+            return L;
+        sample_light(sampled);
+        L = pt.beta * f(pt, sampled.rec.p) * sampled.beta * f(sampled, pt.rec.p) * geometry(pt, sampled);
+        if (!is_black(L) && !visible(scene, pt.rec.p, sampled.rec.p))
+            L = vec3(0.0f);
+    } else {
+        const BDPTVertex& qs = light[s - 1];
+        if (pt.delta || qs.delta || is_emitter(pt))
+            return L;
+        L = qs.beta * f(qs, pt.rec.p) * f(pt, qs.rec.p) * pt.beta * geometry(qs, pt);
+        if (!is_black(L) && !visible(scene, qs.rec.p, pt.rec.p))
+            L = vec3(0.0f);
+    }
+
+    if (is_black(L))
+        return L;
+    return L * mis_weight(scene, light, s, camera, t, sampled);
+}
+
+vec3 BDPT::Li(Scene& scene, int x, int y, Buffer& splat)
+{
+    BDPTVertex camera[kMaxBDPTVertices];
+    BDPTVertex light[kMaxBDPTVertices];
+    int num_camera = camera_subpath(scene, x, y, camera);
+    int num_light = light_subpath(scene, light);
+
+    vec3 L(0.0f);
+    for (int t = 1; t <= num_camera; t++) {
+        for (int s = 0; s <= num_light; s++) {
+            int depth = s + t - 2;
+            if (depth < 0 || depth > kMaxBDPTDepth)
+                continue;
+
+            ivec2 pixel;
+            vec3 contribution = connect(scene, light, s, camera, t, pixel);
+            if (t != 1) {
+                L += contribution;
+            } else if (!is_black(contribution) && std::isfinite(contribution[0]) && std::isfinite(contribution[1]) && std::isfinite(contribution[2])) {
+                splat.add(pixel[0], pixel[1], contribution);
+            }
+        }
+    }
+    return L;
+}
+
+void BDPT::render_sample(Scene& scene, int now_sample)
+{
+    Buffer& buffer = scene.buffer;
+#pragma omp parallel
+    {
+        std::unique_ptr<Sampler> sampler = create_sampler(scene.options);
+        ScopedSampler scoped(*sampler);
+        Buffer& splat = splats[omp_get_thread_num()];
+#pragma omp for schedule(dynamic)
+        for (int y_t = 0; y_t < buffer.height; y_t++) {
+            for (int x_t = 0; x_t < buffer.width; x_t++) {
+                sampler->start_pixel(x_t, y_t, now_sample - 1);
+                vec3 light = Li(scene, x_t, y_t, splat);
+
+                if (std::isfinite(light[0]) && std::isfinite(light[1]) && std::isfinite(light[2])) {
+                    buffer.add(x_t, y_t, light);
+                } else {
+                    DEBUGM("Not finite number at sample %d x %d y %d\n", now_sample, x_t, y_t);
+                }
+            }
+        }
+    }
+
+    // Light tracing contributions are merged once per sample
+    for (auto& splat : splats)
+        buffer.merge(splat);
+}
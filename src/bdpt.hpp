@@ -0,0 +1,60 @@
+#pragma once
+
+#include <vector>
+
+#include "buffer.hpp"
+#include "global.hpp"
+#include "integrator.hpp"
+#include "object.hpp"
+#include "ray.hpp"
+
+class Scene;
+
+struct BDPTVertex {
+    enum vertex_type {
+        CAMERA,
+        LIGHT,
+        SURFACE
+    };
+
+    vertex_type type;
+    HitRecord rec;
+    // Direction towards the previous vertex of the subpath
+    vec3 wo;
+    // Subpath throughput arriving at this vertex
+    vec3 beta;
+    bool delta;
+    // Area measure pdfs of sampling this vertex from either side
+    flt pdf_fwd, pdf_rev;
+};
+
+// Bidirectional path tracing with multiple importance sampling of all strategies
+// Veach, "Robust Monte Carlo Methods for Light Transport Simulation", 1997
+class BDPT : public Integrator {
+public:
+    BDPT();
+    virtual void init(Scene& scene) override;
+    virtual void render_sample(Scene& scene, int now_sample) override;
+
+private:
+    vec3 Li(Scene& scene, int x, int y, Buffer& splat);
+    int camera_subpath(Scene& scene, int x, int y, BDPTVertex* path);
+    int light_subpath(Scene& scene, BDPTVertex* path);
+    int random_walk(Scene& scene, Ray ray, vec3 beta, flt pdf, bool from_camera, BDPTVertex* path);
+    void sample_light(BDPTVertex& vertex);
+
+    vec3 connect(Scene& scene, BDPTVertex* light, int s, BDPTVertex* camera, int t, ivec2& pixel);
+    flt mis_weight(Scene& scene, const BDPTVertex* light, int s, const BDPTVertex* camera, int t, const BDPTVertex& sampled);
+
+    flt pdf(Scene& scene, const BDPTVertex& v, const BDPTVertex* prev, const BDPTVertex& next) const;
+    flt pdf_light(const BDPTVertex& v, const BDPTVertex& next) const;
+    flt pdf_light_origin(const BDPTVertex& v) const;
+    vec3 f(const BDPTVertex& v, const vec3& next) const;
+    vec3 Le(const BDPTVertex& v, const vec3& next) const;
+    bool visible(Scene& scene, const vec3& a, const vec3& b) const;
+
+public:
+    std::vector<Triangle*> lights;
+    // Light tracing contributions of each thread
+    std::vector<Buffer> splats;
+};
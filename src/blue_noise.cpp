@@ -0,0 +1,128 @@
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "blue_noise.hpp"
+#include "global.hpp"
+
+const int kTileSize = 64;
+const flt kTileSigma = 1.5;
+// Share of pixels set in the initial binary pattern
+const flt kInitialDensity = 0.1;
+
+// Energy of every pixel is the sum of a toroidal gaussian around the set pixels
+class EnergyField {
+public:
+    EnergyField(int size, flt sigma)
+        : size(size)
+        , kernel(size * size)
+        , energy(size * size, 0.0f)
+    {
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                int dx = std::min(x, size - x), dy = std::min(y, size - y);
+                kernel[y * size + x] = expf(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+            }
+        }
+    }
+
+    void add(int id, flt sign)
+    {
+        int px = id % size, py = id / size;
+        for (int y = 0; y < size; y++) {
+            int ky = ((y - py + size) % size) * size;
+            for (int x = 0; x < size; x++)
+                energy[y * size + x] += sign * kernel[ky + (x - px + size) % size];
+        }
+    }
+
+    // Set pixel of the highest energy, or unset pixel of the lowest
+    int extreme(const std::vector<char>& pattern, bool tightest_cluster) const
+    {
+        int best = -1;
+        for (int i = 0; i < static_cast<int>(pattern.size()); i++) {
+            if (pattern[i] != tightest_cluster)
+                continue;
+            if (best < 0 || (tightest_cluster ? energy[i] > energy[best] : energy[i] < energy[best]))
+                best = i;
+        }
+        // The callers never ask for a pixel of an empty or full pattern
+        if (best < 0)
+            ERRORM("Blue noise pattern has no %s pixel\n", tightest_cluster ? "set" : "unset");
+        return best;
+    }
+
+private:
+    int size;
+    std::vector<flt> kernel;
+    std::vector<flt> energy;
+};
+
+BlueNoise::BlueNoise(int size, flt sigma, uint64_t seed)
+    : size(size)
+    , values(size * size, 0.0f)
+{
+    int n = size * size;
+    PCG32 rng(seed);
+    std::vector<char> pattern(n, 0);
+    EnergyField field(size, sigma);
+    int num_initial = std::max(1, static_cast<int>(n * kInitialDensity));
+    for (int placed = 0; placed < num_initial;) {
+        int id = std::min(static_cast<int>(rng.next_float() * n), n - 1);
+        if (!pattern[id]) {
+            pattern[id] = 1;
+            field.add(id, 1.0f);
+            placed++;
+        }
+    }
+
+    // Move the tightest cluster into the largest void until the pattern is stable
+    while (num_initial < n) {
+        int cluster = field.extreme(pattern, true);
+        pattern[cluster] = 0;
+        field.add(cluster, -1.0f);
+        int largest_void = field.extreme(pattern, false);
+        pattern[largest_void] = 1;
+        field.add(largest_void, 1.0f);
+        if (largest_void == cluster)
+            break;
+    }
+
+    // Ranks below the initial pattern by removing tightest clusters
+    std::vector<char> prototype = pattern;
+    EnergyField prototype_field = field;
+    std::vector<int> rank(n, 0);
+    for (int r = num_initial - 1; r >= 0; r--) {
+        int cluster = field.extreme(pattern, true);
+        pattern[cluster] = 0;
+        field.add(cluster, -1.0f);
+        rank[cluster] = r;
+    }
+
+    // Ranks above it by filling the largest voids
+    pattern.swap(prototype);
+    field = prototype_field;
+    for (int r = num_initial; r < n; r++) {
+        int largest_void = field.extreme(pattern, false);
+        pattern[largest_void] = 1;
+        field.add(largest_void, 1.0f);
+        rank[largest_void] = r;
+    }
+
+    for (int i = 0; i < n; i++)
+        values[i] = (rank[i] + 0.5f) / n;
+}
+
+flt BlueNoise::value(int x, int y) const
+{
+    x = ((x % size) + size) % size;
+    y = ((y % size) + size) % size;
+    return values[y * size + x];
+}
+
+const BlueNoise& BlueNoise::tile()
+{
+    static const BlueNoise noise(kTileSize, kTileSigma, 0);
+    return noise;
+}
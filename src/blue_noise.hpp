@@ -0,0 +1,23 @@
+#pragma once
+
+#include <vector>
+
+#include "global.hpp"
+
+// Tileable blue-noise ranks built with void-and-cluster, Ulichney 1993
+// "The void-and-cluster method for dither array generation"
+class BlueNoise {
+public:
+    BlueNoise(int size, flt sigma, uint64_t seed);
+    // Value in (0, 1) of pixel (x, y), the tile repeats in both directions
+    flt value(int x, int y) const;
+
+    // Tile shared by the samplers, built on first use
+    static const BlueNoise& tile();
+
+public:
+    int size;
+
+private:
+    std::vector<flt> values;
+};
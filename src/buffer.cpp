@@ -1,4 +1,4 @@
-
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -8,6 +8,11 @@
 #include "buffer.hpp"
 
 Buffer::Buffer()
+    : width(0)
+    , height(0)
+    , x0(0)
+    , y0(0)
+    , samples_channel(-1)
 {
 }
 
@@ -20,37 +25,111 @@ void Buffer::init(int w, int h)
 {
     this->width = w;
     this->height = h;
-    b_array.resize(h);
-    for (auto& col : b_array) {
-        col.resize(w);
+    this->x0 = 0;
+    this->y0 = 0;
+    channels.clear();
+    samples_channel = -1;
+    add_channel("radiance", 3);
+}
+
+// Rows are padded to whole cache lines, channels follow each other
+void Buffer::layout()
+{
+    size_t line = kBufferAlignment / sizeof(flt);
+    size_t offset = 0;
+    for (auto& channel : channels) {
+        channel.offset = offset;
+        channel.stride = (static_cast<size_t>(width) * channel.components + line - 1) / line * line;
+        offset += channel.stride * height;
     }
+    data.assign(offset, 0.0f);
+}
+
+int Buffer::add_channel(const std::string& name, int components)
+{
+    Channel channel = { name, components, 0, 0 };
+    channels.push_back(channel);
+    layout();
+    return channels.size() - 1;
+}
+
+int Buffer::find_channel(const std::string& name) const
+{
+    for (int i = 0; i < static_cast<int>(channels.size()); i++) {
+        if (channels[i].name == name)
+            return i;
+    }
+    return -1;
+}
+
+void Buffer::track_samples()
+{
+    if (samples_channel < 0)
+        samples_channel = add_channel("samples", 1);
 }
 
 void Buffer::clear()
 {
-    vec3 black = vec3(0, 0, 0);
+    std::fill(data.begin(), data.end(), 0.0f);
+}
+
+int Buffer::min_samples() const
+{
+    flt num = INFINITY;
     for (int y_t = 0; y_t < height; y_t++) {
-        for (int x_t = 0; x_t < width; x_t++) {
-            b_array[y_t][x_t] = black;
+        for (int x_t = 0; x_t < width; x_t++)
+            num = std::min(num, samples(x_t, y_t));
+    }
+    return num;
+}
+
+void Buffer::paste(const Buffer& other)
+{
+    if (other.channels.size() != channels.size())
+        ERRORM("Pasting a framebuffer of other channels\n");
+    int left = std::max(other.x0, x0), right = std::min(other.x0 + other.width, x0 + width);
+    int top = std::max(other.y0, y0), bottom = std::min(other.y0 + other.height, y0 + height);
+    for (int c = 0; c < static_cast<int>(channels.size()); c++) {
+        int components = channels[c].components;
+        if (other.channels[c].name != channels[c].name || other.channels[c].components != components)
+            ERRORM("Pasting a framebuffer of other channels\n");
+        for (int y = top; y < bottom; y++) {
+            const flt* src = other.at(c, left - other.x0, y - other.y0);
+            std::copy(src, src + (right - left) * components, at(c, left - x0, y - y0));
         }
     }
 }
 
+void Buffer::merge(Buffer& other)
+{
+    if (other.data.size() != data.size())
+        ERRORM("Merging framebuffers of different layouts\n");
+    long long n = data.size();
+#pragma omp parallel for
+    for (long long i = 0; i < n; i++) {
+        data[i] += other.data[i];
+        other.data[i] = 0.0f;
+    }
+}
+
 void Buffer::to_picture(const std::string& jpgfile, int sample_num, flt gamma) const
 {
     uchar* img = new uchar[height * width * kChannel];
     int pt = 0;
     for (int y_t = 0; y_t < height; y_t++) {
+        const flt* radiance = row(kRadiance, y_t);
         for (int x_t = 0; x_t < width; x_t++) {
-            vec3 color = b_array[y_t][x_t] / (sample_num * 1.0f);
+            flt num = tracks_samples() ? samples(x_t, y_t) : sample_num;
+            vec3 color = num > 0 ? vec3(radiance[0], radiance[1], radiance[2]) / num : vec3(0.0f);
+            radiance += 3;
 
-            // Check if color is in range
+            // Clamp into the displayable range, the linear formats keep the values
             for (int i = 0; i < 3; i++) {
                 if (color[i] >= 1.0) {
                     color[i] = 1.0;
                 }
-                if (color[i] < 0) {
-                    ERRORM("Color %d %d %d is negative %f\n", y_t, x_t, i, color[i]);
+                if (!(color[i] >= 0)) {
+                    color[i] = 0;
                 }
             }
             // Gamma correction
@@ -1,20 +1,131 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdlib>
+#include <new>
 #include <string>
 #include <vector>
 
 #include "global.hpp"
 
+// Cache line size the rows of a framebuffer are aligned to
+const size_t kBufferAlignment = 64;
+
+// Allocator returning kBufferAlignment aligned storage
+template <typename T>
+class AlignedAllocator {
+public:
+    typedef T value_type;
+
+    AlignedAllocator() { }
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U>&) { }
+
+    T* allocate(size_t n)
+    {
+        // The offset to the block returned by malloc is kept just before the aligned storage
+        size_t bytes = n * sizeof(T) + kBufferAlignment + sizeof(void*);
+        char* raw = static_cast<char*>(malloc(bytes));
+        if (!raw)
+            throw std::bad_alloc();
+        uintptr_t start = reinterpret_cast<uintptr_t>(raw) + sizeof(void*);
+        char* aligned = reinterpret_cast<char*>((start + kBufferAlignment - 1) & ~(uintptr_t)(kBufferAlignment - 1));
+        reinterpret_cast<void**>(aligned)[-1] = raw;
+        return reinterpret_cast<T*>(aligned);
+    }
+
+    void deallocate(T* p, size_t)
+    {
+        if (p)
+            free(reinterpret_cast<void**>(p)[-1]);
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U>&) const { return false; }
+};
+
+// Flat framebuffer of several channels. Every channel stores its components
+// interleaved per pixel and every row starts on a cache line, so threads
+// writing different rows or 16 pixel wide tiles never share a line.
 class Buffer {
 public:
+    // Accumulated radiance, always present
+    static const int kRadiance = 0;
+
     Buffer();
     Buffer(int width, int height);
     void init(int width, int height);
     void clear();
 
+    // Adds a channel of components floats per pixel and returns its index, clears the buffer
+    int add_channel(const std::string& name, int components);
+    // Index of a channel, -1 when missing
+    int find_channel(const std::string& name) const;
+    int num_channels() const { return channels.size(); }
+    const std::string& channel_name(int channel) const { return channels[channel].name; }
+    int components(int channel) const { return channels[channel].components; }
+    // Floats between the starts of two rows of a channel
+    size_t stride(int channel) const { return channels[channel].stride; }
+
+    flt* row(int channel, int y) { return &data[channels[channel].offset + y * channels[channel].stride]; }
+    const flt* row(int channel, int y) const { return &data[channels[channel].offset + y * channels[channel].stride]; }
+    flt* at(int channel, int x, int y) { return row(channel, y) + x * channels[channel].components; }
+    const flt* at(int channel, int x, int y) const { return row(channel, y) + x * channels[channel].components; }
+
+    // Radiance accumulated at a pixel
+    vec3 get(int x, int y) const
+    {
+        const flt* p = at(kRadiance, x, y);
+        return vec3(p[0], p[1], p[2]);
+    }
+    void add(int x, int y, const vec3& v)
+    {
+        flt* p = at(kRadiance, x, y);
+        p[0] += v[0];
+        p[1] += v[1];
+        p[2] += v[2];
+    }
+
+    // Counts the samples of every pixel in a channel of their own, images are
+    // then normalized per pixel instead of by the sample number
+    void track_samples();
+    bool tracks_samples() const { return samples_channel >= 0; }
+    flt samples(int x, int y) const { return *at(samples_channel, x, y); }
+    // Adds a radiance sample and counts it
+    void add_sample(int x, int y, const vec3& v)
+    {
+        add(x, y, v);
+        if (samples_channel >= 0)
+            *at(samples_channel, x, y) += 1.0f;
+    }
+
+    // Fewest samples of a pixel, the buffer must track them
+    int min_samples() const;
+
+    // Adds all the channels of a buffer of the same layout, then clears it
+    void merge(Buffer& other);
+    // Replaces the pixels covered by other, a buffer of the same channels placed at its origin
+    void paste(const Buffer& other);
+
     void to_picture(const std::string& jpgfile, int sample_num, flt gamma = 2.0) const;
 
 public:
     int width, height;
-    std::vector<std::vector<vec3>> b_array;
-};
\ No newline at end of file
+    // Pixel (0, 0) is pixel (x0, y0) of the camera image
+    int x0, y0;
+
+private:
+    void layout();
+
+    struct Channel {
+        std::string name;
+        int components;
+        size_t offset;
+        size_t stride;
+    };
+    std::vector<Channel> channels;
+    std::vector<flt, AlignedAllocator<flt>> data;
+    int samples_channel;
+};
@@ -44,6 +44,8 @@ void Camera::init(const tinyxml2::XMLDocument& xmlconfig)
     flt x_length = y_length * aspect;
 
     DEBUGM("xy_length: %f %f\n", x_length, y_length);
+    image_area = x_length * y_length;
+    forward = glm::normalize(lookat - position);
 
     vec4 left_top_corner_origin = vec4(-x_length / 2, y_length / 2, -1, 1);
     vec4 right_top_corner_origin = vec4(x_length / 2, y_length / 2, -1, 1);
@@ -67,3 +69,34 @@ Ray Camera::cast_ray(int x, int y)
 {
     return Ray(position, (left_top_corner + (x + uniform() - 0.5f) * dw + (y + uniform() - 0.5f) * dh) - position);
 }
+
+bool Camera::raster(const vec3& p, ivec2& pixel) const
+{
+    vec3 d = p - position;
+    flt depth = glm::dot(d, forward);
+    if (depth <= 0)
+        return false;
+
+    // cast_ray(x, y) covers [x - 0.5, x + 0.5) on the image plane
+    vec3 q = position + d / depth - left_top_corner;
+    flt fx = glm::dot(q, dw) / glm::dot(dw, dw);
+    flt fy = glm::dot(q, dh) / glm::dot(dh, dh);
+    pixel = ivec2(floorf(fx + 0.5f), floorf(fy + 0.5f));
+    return inside(pixel[0], 0, width - 1) && inside(pixel[1], 0, height - 1);
+}
+
+flt Camera::importance(const vec3& dir) const
+{
+    flt cos_theta = glm::dot(dir, forward);
+    if (cos_theta <= 0)
+        return 0.0f;
+    return 1.0f / (image_area * sq(sq(cos_theta)));
+}
+
+flt Camera::pdf_dir(const vec3& dir) const
+{
+    flt cos_theta = glm::dot(dir, forward);
+    if (cos_theta <= 0)
+        return 0.0f;
+    return 1.0f / (image_area * cos_theta * sq(cos_theta));
+}
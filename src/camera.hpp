@@ -11,6 +11,13 @@ public:
     void init(const tinyxml2::XMLDocument& xmlconfig);
     Ray cast_ray(int x, int y);
 
+    // Pixel seen through the pinhole at p, false if p is behind or outside the image
+    bool raster(const vec3& p, ivec2& pixel) const;
+    // Importance emitted along a normalized direction, normalized over the image plane
+    flt importance(const vec3& dir) const;
+    // Solid angle pdf of cast_ray generating a normalized direction
+    flt pdf_dir(const vec3& dir) const;
+
 public:
     vec3 position;
     vec3 up;
@@ -21,4 +28,7 @@ public:
     int width, height;
     vec3 dw, dh;
     vec3 left_top_corner;
+    vec3 forward;
+    // Area of the image plane at distance 1
+    flt image_area;
 };
\ No newline at end of file
@@ -0,0 +1,153 @@
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "buffer.hpp"
+#include "checkpoint.hpp"
+#include "global.hpp"
+
+static const char kCheckpointMagic[8] = { 'M', 'C', 'P', 'T', 'C', 'K', 'P', 'T' };
+const int kCheckpointVersion = 3;
+
+CheckpointInfo::CheckpointInfo()
+    : blue_noise(false)
+    , first(1)
+    , rendered(0)
+    , part(0)
+    , parts(1)
+{
+}
+
+static bool write_int(FILE* fp, int v)
+{
+    return fwrite(&v, sizeof(v), 1, fp) == 1;
+}
+
+static bool read_int(FILE* fp, int& v)
+{
+    return fread(&v, sizeof(v), 1, fp) == 1;
+}
+
+static bool write_string(FILE* fp, const std::string& s)
+{
+    return write_int(fp, s.size()) && fwrite(s.data(), 1, s.size(), fp) == s.size();
+}
+
+static bool read_string(FILE* fp, std::string& s)
+{
+    int n;
+    if (!read_int(fp, n) || n < 0 || n > 4096)
+        return false;
+    s.resize(n);
+    return n == 0 || fread(&s[0], 1, n, fp) == static_cast<size_t>(n);
+}
+
+bool write_checkpoint(FILE* fp, const Buffer& buffer, const CheckpointInfo& info)
+{
+    bool ok = fwrite(kCheckpointMagic, sizeof(kCheckpointMagic), 1, fp) == 1
+        && write_int(fp, kCheckpointVersion)
+        && write_string(fp, info.integrator)
+        && write_string(fp, info.sampler)
+        && write_int(fp, info.blue_noise)
+        && write_int(fp, info.first)
+        && write_int(fp, info.rendered)
+        && write_int(fp, info.part)
+        && write_int(fp, info.parts)
+        && write_int(fp, buffer.width)
+        && write_int(fp, buffer.height)
+        && write_int(fp, buffer.x0)
+        && write_int(fp, buffer.y0)
+        && write_int(fp, buffer.num_channels());
+    for (int c = 0; ok && c < buffer.num_channels(); c++)
+        ok = write_string(fp, buffer.channel_name(c)) && write_int(fp, buffer.components(c));
+    for (int c = 0; ok && c < buffer.num_channels(); c++) {
+        size_t row_size = static_cast<size_t>(buffer.width) * buffer.components(c);
+        for (int y = 0; ok && y < buffer.height; y++)
+            ok = fwrite(buffer.row(c, y), sizeof(flt), row_size, fp) == row_size;
+    }
+    return ok && fflush(fp) == 0;
+}
+
+bool read_checkpoint(FILE* fp, Buffer& buffer, CheckpointInfo& info, bool adopt_layout)
+{
+    char magic[sizeof(kCheckpointMagic)];
+    int version, blue_noise, width, height, x0, y0, num_channels;
+    bool ok = fread(magic, sizeof(magic), 1, fp) == 1
+        && memcmp(magic, kCheckpointMagic, sizeof(magic)) == 0
+        && read_int(fp, version) && version == kCheckpointVersion
+        && read_string(fp, info.integrator)
+        && read_string(fp, info.sampler)
+        && read_int(fp, blue_noise)
+        && read_int(fp, info.first)
+        && read_int(fp, info.rendered)
+        && read_int(fp, info.part)
+        && read_int(fp, info.parts)
+        && read_int(fp, width) && width > 0
+        && read_int(fp, height) && height > 0
+        && read_int(fp, x0)
+        && read_int(fp, y0)
+        && read_int(fp, num_channels) && num_channels > 0;
+    info.blue_noise = blue_noise;
+    if (!ok)
+        return false;
+
+    std::vector<std::string> names(num_channels);
+    std::vector<int> components(num_channels);
+    for (int c = 0; ok && c < num_channels; c++)
+        ok = read_string(fp, names[c]) && read_int(fp, components[c]) && components[c] > 0;
+    if (!ok || names[0] != "radiance" || components[0] != 3)
+        return false;
+    if (adopt_layout) {
+        buffer.init(width, height);
+        buffer.x0 = x0;
+        buffer.y0 = y0;
+        for (int c = 1; c < num_channels; c++) {
+            if (names[c] == "samples")
+                buffer.track_samples();
+            else
+                buffer.add_channel(names[c], components[c]);
+        }
+    }
+    if (width != buffer.width || height != buffer.height || x0 != buffer.x0 || y0 != buffer.y0 || num_channels != buffer.num_channels())
+        return false;
+    for (int c = 0; c < num_channels; c++) {
+        if (names[c] != buffer.channel_name(c) || components[c] != buffer.components(c))
+            return false;
+    }
+
+    for (int c = 0; ok && c < num_channels; c++) {
+        size_t row_size = static_cast<size_t>(buffer.width) * buffer.components(c);
+        for (int y = 0; ok && y < buffer.height; y++)
+            ok = fread(buffer.row(c, y), sizeof(flt), row_size, fp) == row_size;
+    }
+    return ok;
+}
+
+bool save_checkpoint(const std::string& file, const Buffer& buffer, const CheckpointInfo& info)
+{
+    std::string tmp = file + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (!fp)
+        return false;
+    bool ok = write_checkpoint(fp, buffer, info) && fsync(fileno(fp)) == 0;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), file.c_str()) != 0) {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool load_checkpoint(const std::string& file, Buffer& buffer, CheckpointInfo& info, bool adopt_layout)
+{
+    FILE* fp = fopen(file.c_str(), "rb");
+    if (!fp)
+        return false;
+    bool ok = read_checkpoint(fp, buffer, info, adopt_layout);
+    fclose(fp);
+    return ok;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+
+#include "buffer.hpp"
+#include "global.hpp"
+
+// What a render needs besides the framebuffer to continue where it stopped. The
+// samplers have no state of their own, the numbers of a pixel sample only depend
+// on the pixel and the sample index, so the sample counts are enough.
+struct CheckpointInfo {
+    std::string integrator;
+    std::string sampler;
+    bool blue_noise;
+    // Samples first to rendered are in the framebuffer, pixels tracked by the
+    // framebuffer may have more
+    int first;
+    int rendered;
+    // Part of a distributed render, 0 of 1 otherwise
+    int part;
+    int parts;
+
+    CheckpointInfo();
+    // Samples every pixel has
+    int num_samples() const { return rendered - first + 1; }
+};
+
+// Linear framebuffer channels after a small header. With adopt_layout the buffer
+// takes the size, origin and channels of the checkpoint, otherwise they must match.
+bool write_checkpoint(FILE* fp, const Buffer& buffer, const CheckpointInfo& info);
+bool read_checkpoint(FILE* fp, Buffer& buffer, CheckpointInfo& info, bool adopt_layout = false);
+
+// The file is written next to its destination and renamed, so an interrupted
+// write keeps the last checkpoint
+bool save_checkpoint(const std::string& file, const Buffer& buffer, const CheckpointInfo& info);
+// Fails when the file is missing, broken or of another image size or channel layout
+bool load_checkpoint(const std::string& file, Buffer& buffer, CheckpointInfo& info, bool adopt_layout = false);
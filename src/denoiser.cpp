@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "buffer.hpp"
+#include "denoiser.hpp"
+#include "global.hpp"
+
+// Passes of the 5x5 filter, the last one reaches 2^(kDenoiseIterations - 1) pixels away
+const int kDenoiseIterations = 3;
+// Luminance differences are scaled by this many standard deviations
+const flt kSigmaLuminance = 4.0;
+// Exponent of the cosine between two normals
+const flt kSigmaNormal = 64.0;
+// Relative depth difference per pixel of distance
+const flt kSigmaDepth = 0.02;
+// Albedo difference
+const flt kSigmaAlbedo = 0.1;
+// Albedo below this is not divided out
+const flt kMinAlbedo = 0.01;
+
+FeatureChannels::FeatureChannels()
+    : albedo(-1)
+    , normal(-1)
+    , depth(-1)
+    , emission(-1)
+    , luminance2(-1)
+{
+}
+
+void FeatureChannels::add_to(Buffer& buffer)
+{
+    albedo = buffer.add_channel("albedo", 3);
+    normal = buffer.add_channel("normal", 3);
+    depth = buffer.add_channel("depth", 1);
+    emission = buffer.add_channel("emission", 3);
+    luminance2 = buffer.add_channel("luminance2", 1);
+}
+
+// Per-pixel guide of the filter
+struct Guide {
+    vec3 albedo;
+    vec3 normal;
+    flt depth;
+    bool hit;
+};
+
+static vec3 divide_albedo(const vec3& c, const vec3& albedo)
+{
+    return vec3(c[0] / std::max(albedo[0], kMinAlbedo), c[1] / std::max(albedo[1], kMinAlbedo), c[2] / std::max(albedo[2], kMinAlbedo));
+}
+
+static vec3 multiply_albedo(const vec3& c, const vec3& albedo)
+{
+    return vec3(c[0] * std::max(albedo[0], kMinAlbedo), c[1] * std::max(albedo[1], kMinAlbedo), c[2] * std::max(albedo[2], kMinAlbedo));
+}
+
+void denoise(const Buffer& buffer, const FeatureChannels& features, Buffer& out)
+{
+    int width = buffer.width, height = buffer.height;
+    size_t n = static_cast<size_t>(width) * height;
+    std::vector<Guide> guides(n);
+    std::vector<vec3> emission(n);
+    std::vector<vec3> illumination(n), next_illumination(n);
+    std::vector<flt> variance(n), next_variance(n);
+
+    // Means of the samples, the variance is that of the mean
+#pragma omp parallel for
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            size_t i = static_cast<size_t>(y) * width + x;
+            flt num = buffer.samples(x, y);
+            Guide& guide = guides[i];
+            if (num <= 0) {
+                guide.hit = false;
+                emission[i] = illumination[i] = vec3(0.0f);
+                variance[i] = 0;
+                continue;
+            }
+            const flt* e = buffer.at(features.emission, x, y);
+            emission[i] = vec3(e[0], e[1], e[2]) / num;
+            const flt* a = buffer.at(features.albedo, x, y);
+            const flt* nrm = buffer.at(features.normal, x, y);
+            guide.albedo = vec3(a[0], a[1], a[2]) / num;
+            guide.normal = vec3(nrm[0], nrm[1], nrm[2]);
+            guide.depth = *buffer.at(features.depth, x, y) / num;
+            guide.hit = glm::length(guide.normal) > 0;
+            if (guide.hit)
+                guide.normal = glm::normalize(guide.normal);
+
+            vec3 mean = buffer.get(x, y) / num - emission[i];
+            flt mean2 = *buffer.at(features.luminance2, x, y) / num;
+            flt sample_variance = std::max(0.0f, mean2 - luminance(mean) * luminance(mean));
+            flt scale = luminance(divide_albedo(mean, guide.albedo)) / std::max(luminance(mean), 1e-6f);
+            illumination[i] = guide.hit ? divide_albedo(mean, guide.albedo) : mean;
+            variance[i] = sample_variance / std::max(num - 1.0f, 1.0f) * scale * scale;
+        }
+    }
+
+    const flt kernel[3] = { 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+    for (int iteration = 0; iteration < kDenoiseIterations; iteration++) {
+        int step = 1 << iteration;
+#pragma omp parallel for schedule(dynamic)
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                size_t i = static_cast<size_t>(y) * width + x;
+                const Guide& center = guides[i];
+                if (!center.hit) {
+                    next_illumination[i] = illumination[i];
+                    next_variance[i] = variance[i];
+                    continue;
+                }
+
+                // Standard deviation blurred over 3x3 pixels, single pixels are too noisy
+                flt blurred = 0, blurred_weight = 0;
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        int qx = x + dx, qy = y + dy;
+                        if (qx < 0 || qx >= width || qy < 0 || qy >= height)
+                            continue;
+                        flt w = (dx == 0 ? 2 : 1) * (dy == 0 ? 2 : 1);
+                        blurred += w * variance[static_cast<size_t>(qy) * width + qx];
+                        blurred_weight += w;
+                    }
+                }
+                flt sigma = kSigmaLuminance * sqrtf(blurred / blurred_weight) + 1e-6f;
+                flt center_luminance = luminance(illumination[i]);
+
+                vec3 sum(0.0f);
+                flt sum_variance = 0, sum_weight = 0;
+                for (int ky = -2; ky <= 2; ky++) {
+                    for (int kx = -2; kx <= 2; kx++) {
+                        int qx = x + kx * step, qy = y + ky * step;
+                        if (qx < 0 || qx >= width || qy < 0 || qy >= height)
+                            continue;
+                        size_t j = static_cast<size_t>(qy) * width + qx;
+                        const Guide& other = guides[j];
+                        if (!other.hit)
+                            continue;
+                        flt distance = step * sqrtf(static_cast<flt>(kx * kx + ky * ky));
+                        flt depth_scale = kSigmaDepth * center.depth * std::max(distance, 1.0f);
+                        flt exponent = fabsf(luminance(illumination[j]) - center_luminance) / sigma
+                            + fabsf(other.depth - center.depth) / (depth_scale + 1e-6f)
+                            + glm::length(other.albedo - center.albedo) / kSigmaAlbedo;
+                        flt w = kernel[abs(kx)] * kernel[abs(ky)]
+                            * powf(std::max(0.0f, glm::dot(center.normal, other.normal)), kSigmaNormal) * expf(-exponent);
+                        sum += w * illumination[j];
+                        sum_variance += w * w * variance[j];
+                        sum_weight += w;
+                    }
+                }
+                next_illumination[i] = sum / sum_weight;
+                next_variance[i] = sum_variance / (sum_weight * sum_weight);
+            }
+        }
+        illumination.swap(next_illumination);
+        variance.swap(next_variance);
+    }
+
+    out.init(width, height);
+#pragma omp parallel for
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            size_t i = static_cast<size_t>(y) * width + x;
+            out.add(x, y, emission[i] + (guides[i].hit ? multiply_albedo(illumination[i], guides[i].albedo) : illumination[i]));
+        }
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "buffer.hpp"
+#include "global.hpp"
+
+// Framebuffer channels of the first-hit features, accumulated per sample like the
+// radiance. Hits are followed through glass as in the preview integrators.
+struct FeatureChannels {
+    // Texture-aware diffuse reflectance, times the glass transmittance
+    int albedo;
+    // Shading normal facing the camera
+    int normal;
+    // Distance along the camera ray
+    int depth;
+    // Emission seen directly, it is not filtered
+    int emission;
+    // Squared luminance of the radiance samples without the emission, for the per-pixel variance
+    int luminance2;
+
+    FeatureChannels();
+    bool enabled() const { return albedo >= 0; }
+    // Adds the channels, the buffer must track the sample counts
+    void add_to(Buffer& buffer);
+};
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) of the illumination,
+// the radiance without the emission divided by the albedo. Neighbours are weighted by their normals,
+// depths and albedos, and by the luminance difference relative to the filtered
+// per-pixel standard deviation (Schied et al. 2017). out gets the denoised mean
+// radiance, written as one sample.
+void denoise(const Buffer& buffer, const FeatureChannels& features, Buffer& out);
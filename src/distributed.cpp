@@ -0,0 +1,218 @@
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "buffer.hpp"
+#include "checkpoint.hpp"
+#include "distributed.hpp"
+#include "global.hpp"
+
+void part_samples(int part, int parts, int num_sample, int& first, int& last)
+{
+    first = static_cast<long long>(num_sample) * part / parts + 1;
+    last = static_cast<long long>(num_sample) * (part + 1) / parts;
+}
+
+std::string partial_file(const std::string& outfile, int part)
+{
+    return outfile.substr(0, outfile.find_last_of('.')) + ".part" + std::to_string(part) + ".ckpt";
+}
+
+int merge_partials(const std::vector<std::string>& files, Buffer& buffer, CheckpointInfo& info, bool& resumable)
+{
+    Buffer partial;
+    std::vector<bool> seen;
+    // Sample ranges of the parts, resuming continues after them if they cover 1 to n
+    std::vector<std::pair<int, int>> ranges;
+    int num_samples = 0;
+    for (int i = 0; i < static_cast<int>(files.size()); i++) {
+        CheckpointInfo part_info;
+        if (!load_checkpoint(files[i], i == 0 ? buffer : partial, part_info, true))
+            ERRORM("Cannot read %s\n", files[i].c_str());
+        if (i == 0) {
+            info = part_info;
+            seen.assign(info.parts, false);
+        } else {
+            if (part_info.integrator != info.integrator || part_info.sampler != info.sampler || part_info.blue_noise != info.blue_noise)
+                ERRORM("%s was rendered by another integrator or sampler\n", files[i].c_str());
+            if (part_info.parts != info.parts)
+                ERRORM("%s is a part of %d, not %d\n", files[i].c_str(), part_info.parts, info.parts);
+            if (partial.width != buffer.width || partial.height != buffer.height || partial.x0 != buffer.x0 || partial.y0 != buffer.y0
+                || partial.num_channels() != buffer.num_channels())
+                ERRORM("%s is of another image size\n", files[i].c_str());
+            buffer.merge(partial);
+        }
+        if (part_info.part < 0 || part_info.part >= info.parts || seen[part_info.part])
+            ERRORM("%s is part %d again, its samples would be counted twice\n", files[i].c_str(), part_info.part);
+        seen[part_info.part] = true;
+        ranges.push_back(std::make_pair(part_info.first, part_info.rendered));
+        num_samples += part_info.num_samples();
+    }
+    for (int part = 0; part < static_cast<int>(seen.size()); part++) {
+        if (!seen[part])
+            INFO("Part %d of %d is missing\n", part, info.parts);
+    }
+    std::sort(ranges.begin(), ranges.end());
+    int next = 1;
+    for (auto& range : ranges) {
+        if (range.first != next)
+            break;
+        next = range.second + 1;
+    }
+    resumable = next == ranges.back().second + 1;
+
+    if (buffer.tracks_samples())
+        num_samples = buffer.min_samples();
+    info.part = 0;
+    info.parts = 1;
+    info.first = 1;
+    info.rendered = num_samples;
+    return num_samples;
+}
+
+static bool send_all(int fd, const void* data, size_t size)
+{
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, void* data, size_t size)
+{
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static sockaddr_un socket_address(const std::string& socket_path)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path))
+        ERRORM("Socket path %s is too long\n", socket_path.c_str());
+    strcpy(addr.sun_path, socket_path.c_str());
+    return addr;
+}
+
+void coordinate(const std::string& socket_path, int parts, const std::string& outfile)
+{
+    sockaddr_un addr = socket_address(socket_path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path.c_str());
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listener, 64) != 0)
+        ERRORM("Cannot listen on %s\n", socket_path.c_str());
+    INFO("Coordinating %d parts on %s\n", parts, socket_path.c_str());
+
+    std::deque<int> pending;
+    for (int part = 0; part < parts; part++)
+        pending.push_back(part);
+    int received = 0;
+    std::mutex mutex;
+    std::vector<std::thread> receivers;
+    // Workers connected while every part was out wait for a lost one
+    std::deque<int> idle;
+    auto hand_out = [&](int connection, int part) {
+        INFO("Part %d handed out\n", part);
+        int message[2] = { part, parts };
+        receivers.emplace_back([&, connection, part, message] {
+            Buffer partial;
+            CheckpointInfo info;
+            FILE* fp = fdopen(connection, "rb");
+            bool ok = fp && send_all(connection, message, sizeof(message))
+                && read_checkpoint(fp, partial, info, true) && info.part == part && info.parts == parts;
+            if (fp)
+                fclose(fp);
+            else
+                close(connection);
+            ok = ok && save_checkpoint(partial_file(outfile, part), partial, info);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (ok) {
+                received++;
+                INFO("Part %d received, %d of %d\n", part, received, parts);
+            } else {
+                pending.push_back(part);
+                INFO("Part %d is lost and handed out again\n", part);
+            }
+        });
+    };
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (received == parts)
+                break;
+            for (; !pending.empty() && !idle.empty(); idle.pop_front(), pending.pop_front())
+                hand_out(idle.front(), pending.front());
+        }
+        // Wakes up now and then to notice the last part arriving or a part being lost
+        pollfd waiting = { listener, POLLIN, 0 };
+        if (poll(&waiting, 1, 1000) <= 0)
+            continue;
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection >= 0)
+            idle.push_back(connection);
+    }
+    for (int connection : idle) {
+        int message[2] = { -1, parts };
+        send_all(connection, message, sizeof(message));
+        close(connection);
+    }
+    for (auto& receiver : receivers)
+        receiver.join();
+    close(listener);
+    unlink(socket_path.c_str());
+}
+
+int request_part(const std::string& socket_path, int& part, int& parts)
+{
+    sockaddr_un addr = socket_address(socket_path);
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection < 0 || connect(connection, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+        ERRORM("Cannot connect to the coordinator on %s\n", socket_path.c_str());
+    int message[2];
+    if (!recv_all(connection, message, sizeof(message)) || message[0] < 0) {
+        close(connection);
+        return -1;
+    }
+    part = message[0];
+    parts = message[1];
+    return connection;
+}
+
+bool send_partial(int connection, const std::string& file)
+{
+    FILE* fp = fopen(file.c_str(), "rb");
+    bool ok = fp != nullptr;
+    char chunk[1 << 16];
+    size_t n;
+    while (ok && (n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+        ok = send_all(connection, chunk, n);
+    if (fp)
+        fclose(fp);
+    close(connection);
+    return ok;
+}
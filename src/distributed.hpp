@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "buffer.hpp"
+#include "checkpoint.hpp"
+#include "global.hpp"
+
+// A distributed render splits the sample numbers into parts rendered by separate
+// processes. Every part is a partial checkpoint, their sum is the full render, as
+// the numbers of a pixel sample only depend on the pixel and the sample index.
+
+// Samples first to last of part out of parts, of num_sample samples
+void part_samples(int part, int parts, int num_sample, int& first, int& last);
+// Partial buffer of a part of dir/name.jpg is dir/name.part{part}.ckpt
+std::string partial_file(const std::string& outfile, int part);
+
+// Adds up partial buffers, buffer takes the layout of the first one. Returns the
+// samples every pixel has, missing parts are reported. The sum is resumable only
+// if the parts cover the samples from 1 on without a gap.
+int merge_partials(const std::vector<std::string>& files, Buffer& buffer, CheckpointInfo& info, bool& resumable);
+
+// Coordinator listening on a Unix socket. Hands the parts to the workers as they
+// connect, stores the partial buffer sent back as partial_file(outfile, part)
+// and returns when all the parts arrived. The part of a lost worker is handed out again.
+void coordinate(const std::string& socket_path, int parts, const std::string& outfile);
+// Asks the coordinator for a part, returns the connection or -1 when no part is left
+int request_part(const std::string& socket_path, int& part, int& parts);
+// Sends the partial buffer of a part and closes the connection
+bool send_partial(int connection, const std::string& file);
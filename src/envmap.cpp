@@ -0,0 +1,143 @@
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "glm/glm.hpp"
+#include "stb/stb_image.h"
+
+#include "envmap.hpp"
+#include "global.hpp"
+
+EnvironmentMap::EnvironmentMap()
+    : scale(1)
+{
+}
+
+void EnvironmentMap::init(const std::string& file, flt env_scale)
+{
+    scale = env_scale;
+    int load_channel;
+    texture.t_ptr = stbi_loadf(file.c_str(), &(texture.width), &(texture.height), &load_channel, kChannel);
+    if (!texture.t_ptr) {
+        ERRORM("Cannot load environment map %s\n", file.c_str());
+    }
+
+    int width = texture.width, height = texture.height;
+    func.assign(width * height, 0.0f);
+    marginal_cdf.assign(height + 1, 0.0f);
+    conditional_cdf.assign(height * (width + 1), 0.0f);
+
+    // Rows near the poles cover less solid angle
+    flt sum = 0.0f;
+    for (int y = 0; y < height; y++) {
+        flt sin_theta = sinf(PI * (y + 0.5f) / height);
+        for (int x = 0; x < width; x++)
+            func[y * width + x] = luminance(texture.at(x, y)) * sin_theta;
+    }
+    for (int y = 0; y < height; y++) {
+        flt* cdf = &conditional_cdf[y * (width + 1)];
+        for (int x = 0; x < width; x++)
+            cdf[x + 1] = cdf[x] + func[y * width + x];
+        marginal_cdf[y + 1] = marginal_cdf[y] + cdf[width];
+        sum += cdf[width];
+    }
+    if (!(sum > 0))
+        ERRORM("Environment map %s is black\n", file.c_str());
+
+    for (auto& f : func)
+        f *= width * height / sum;
+    for (int y = 0; y < height; y++) {
+        flt* cdf = &conditional_cdf[y * (width + 1)];
+        flt row = cdf[width];
+        for (int x = 1; x <= width; x++)
+            cdf[x] = row > 0 ? cdf[x] / row : static_cast<flt>(x) / width;
+    }
+    for (int y = 1; y <= height; y++)
+        marginal_cdf[y] /= sum;
+    DEBUGM("environment map: %s  width: %d  height: %d  scale: %f\n", file.c_str(), width, height, scale);
+}
+
+void EnvironmentMap::to_texel(const vec3& dir, int& x, int& y) const
+{
+    flt u = atan2f(dir[0], -dir[2]) / (2 * PI) + 0.5f;
+    flt v = acosf(clamp(dir[1], -1.0f, 1.0f)) / PI;
+    x = std::min(static_cast<int>(u * texture.width), texture.width - 1);
+    y = std::min(static_cast<int>(v * texture.height), texture.height - 1);
+}
+
+vec3 EnvironmentMap::Le(const vec3& dir) const
+{
+    int x, y;
+    to_texel(dir, x, y);
+    return scale * texture.at(x, y);
+}
+
+// Position of u inside the cdf bucket it falls into, in [0, n)
+static flt sample_cdf(const flt* cdf, int n, flt u, int& id)
+{
+    id = std::upper_bound(cdf, cdf + n + 1, u) - cdf - 1;
+    id = clamp(id, 0, n - 1);
+    flt width = cdf[id + 1] - cdf[id];
+    flt du = width > 0 ? (u - cdf[id]) / width : 0.5f;
+    return id + clamp(du, 0.0f, 1.0f - kEps);
+}
+
+vec3 EnvironmentMap::sample_direction(flt& pdf) const
+{
+    int width = texture.width, height = texture.height;
+    int x, y;
+    flt v = sample_cdf(marginal_cdf.data(), height, uniform(), y) / height;
+    flt u = sample_cdf(&conditional_cdf[y * (width + 1)], width, uniform(), x) / width;
+
+    flt theta = PI * v, phi = 2 * PI * (u - 0.5f);
+    flt sin_theta = sinf(theta);
+    pdf = sin_theta > 0 ? func[y * width + x] / (2 * PI * PI * sin_theta) : 0.0f;
+    return vec3(sin_theta * sinf(phi), cosf(theta), -sin_theta * cosf(phi));
+}
+
+flt EnvironmentMap::pdf_direction(const vec3& dir) const
+{
+    int x, y;
+    to_texel(dir, x, y);
+    flt sin_theta = sqrtf(std::max(0.0f, 1.0f - dir[1] * dir[1]));
+    return sin_theta > 0 ? func[y * texture.width + x] / (2 * PI * PI * sin_theta) : 0.0f;
+}
+
+vec3 EnvironmentMap::emitted(const HitRecord& light_rec, const vec3& wi) const
+{
+    return Le(wi);
+}
+
+flt EnvironmentMap::get_area() const
+{
+    return 0.0f;
+}
+
+flt EnvironmentMap::sample_ray(const HitRecord& rec, const Hittable* world, HitRecord& light_rec, vec3& wi) const
+{
+    flt pdf;
+    wi = sample_direction(pdf);
+    if (!(pdf > 0) || glm::dot(rec.normal, wi) <= 0
+        || world->hit(Ray(rec.p, wi), vec2(kHitEps, INFINITY), light_rec))
+        return 0.0f;
+
+    light_rec.t = INFINITY;
+    light_rec.mat = NULL;
+    light_rec.obj = NULL;
+    light_rec.light = this;
+    return pdf;
+}
+
+flt EnvironmentMap::pdf(const Ray& ray, const Hittable* world, HitRecord& light_rec) const
+{
+    if (world->hit(ray, vec2(kHitEps, INFINITY), light_rec))
+        return 0.0f;
+
+    light_rec.t = INFINITY;
+    light_rec.mat = NULL;
+    light_rec.obj = NULL;
+    light_rec.light = this;
+    return pdf_direction(ray.direction);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "global.hpp"
+#include "material.hpp"
+#include "object.hpp"
+#include "ray.hpp"
+
+// Latitude-longitude HDR environment at infinity, y is up. Directions are
+// sampled from a piecewise-constant distribution over the texels weighted by
+// luminance and sin(theta): a marginal cdf over the rows and a conditional
+// cdf over the columns of every row.
+class EnvironmentMap : public Emissive {
+public:
+    EnvironmentMap();
+    void init(const std::string& file, flt scale);
+
+    // Radiance arriving from the normalized direction dir
+    vec3 Le(const vec3& dir) const;
+    vec3 sample_direction(flt& pdf) const;
+    // Solid angle pdf of sample_direction
+    flt pdf_direction(const vec3& dir) const;
+
+    virtual flt get_area() const override;
+    // Light records of the environment have no material and no object
+    virtual flt sample_ray(const HitRecord& rec, const Hittable* world, HitRecord& light_rec, vec3& wi) const override;
+    virtual flt pdf(const Ray& ray, const Hittable* world, HitRecord& light_rec) const override;
+    virtual vec3 emitted(const HitRecord& light_rec, const vec3& wi) const override;
+
+public:
+    Texture texture;
+    flt scale;
+
+private:
+    void to_texel(const vec3& dir, int& x, int& y) const;
+
+    // Marginal cdf of the rows, height + 1 entries
+    std::vector<flt> marginal_cdf;
+    // Conditional cdf of the columns, height rows of width + 1 entries
+    std::vector<flt> conditional_cdf;
+    // Texel weights normalized to a mean of 1
+    std::vector<flt> func;
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <cstdio>
 #include <glm/glm.hpp>
 #include <glm/gtx/component_wise.hpp>
@@ -77,10 +78,70 @@ inline T sq(T x)
     return x * x;
 }
 
+inline flt luminance(const vec3& c)
+{
+    return (c[0] + c[1] + c[2]) / 3.0f;
+}
+
+// PCG32 generator (O'Neill 2014), 16 bytes of state
+class PCG32 {
+public:
+    PCG32(uint64_t seed = 0, uint64_t stream = 0) { this->seed(seed, stream); }
+
+    void seed(uint64_t seed, uint64_t stream)
+    {
+        state = 0;
+        inc = (stream << 1) | 1;
+        next_uint();
+        state += seed;
+        next_uint();
+    }
+
+    uint32_t next_uint()
+    {
+        uint64_t old = state;
+        state = old * 6364136223846793005ull + inc;
+        uint32_t xorshifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+        uint32_t rot = static_cast<uint32_t>(old >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+    }
+
+    // Uniform in [0, 1)
+    flt next_float() { return (next_uint() >> 8) * (1.0f / 16777216.0f); }
+
+private:
+    uint64_t state, inc;
+};
+
+// Replaces the pseudo-random numbers of uniform() on the current thread,
+// e.g. with a primary sample space vector for Metropolis light transport
+class RandomSource {
+public:
+    virtual flt next() = 0;
+    // Hint that the following numbers make up dimension dim onward of the sample
+    virtual void start_dimension(int dim) { }
+};
+
+inline RandomSource*& random_source()
+{
+    static thread_local RandomSource* source = NULL;
+    return source;
+}
+
+inline void sample_dimension(int dim)
+{
+    RandomSource* source = random_source();
+    if (source)
+        source->start_dimension(dim);
+}
+
 inline flt uniform(flt l = 0.0, flt h = 1.0)
 {
+    RandomSource* source = random_source();
+    if (source)
+        return l + (h - l) * source->next();
+
     static thread_local std::random_device dev;
-    static thread_local std::mt19937 mt(dev());
-    std::uniform_real_distribution<flt> rng(l, h);
-    return rng(mt);
-}
\ No newline at end of file
+    static thread_local PCG32 rng(dev(), dev());
+    return l + (h - l) * rng.next_float();
+}
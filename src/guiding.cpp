@@ -0,0 +1,297 @@
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "bbox.hpp"
+#include "global.hpp"
+#include "guiding.hpp"
+
+// A spatial leaf is split once it receives more than c * sqrt(2^k) samples in pass k
+const flt kSpatialThreshold = 12000;
+// A quadrant is subdivided once it holds more than this fraction of the energy
+const flt kDirectionalThreshold = 0.01;
+const int kMaxDTreeDepth = 20;
+
+// Cylindrical mapping, preserves area so the pdf on the sphere is pdf_square / (4 * PI)
+inline vec2 dir_to_canonical(const vec3& dir)
+{
+    flt cos_theta = clamp(dir[2], -1.0f, 1.0f);
+    flt phi = atan2f(dir[1], dir[0]);
+    if (phi < 0)
+        phi += 2 * PI;
+    return vec2((cos_theta + 1.0f) * 0.5f, std::min(phi / (2 * PI), 1.0f));
+}
+
+inline vec3 canonical_to_dir(const vec2& p)
+{
+    flt cos_theta = 2 * p[0] - 1;
+    flt sin_theta = sqrtf(std::max(0.0f, 1.0f - cos_theta * cos_theta));
+    flt phi = 2 * PI * p[1];
+    return vec3(sin_theta * cosf(phi), sin_theta * sinf(phi), cos_theta);
+}
+
+inline int quadrant(const vec2& p)
+{
+    return (p[0] >= 0.5f ? 1 : 0) + (p[1] >= 0.5f ? 2 : 0);
+}
+
+DTree::DTree()
+{
+    nodes.assign(1, Node());
+}
+
+flt DTree::total() const
+{
+    const Node& root = nodes[0];
+    return root.sum[0] + root.sum[1] + root.sum[2] + root.sum[3];
+}
+
+vec3 DTree::sample(flt& pdf) const
+{
+    if (!(this->total() > 0)) {
+        pdf = 1.0f / (4 * PI);
+        return canonical_to_dir(vec2(uniform(), uniform()));
+    }
+
+    flt pdf_square = 1.0f;
+    flt scale = 1.0f;
+    vec2 offset(0.0f);
+    int id = 0;
+    while (true) {
+        const Node& node = nodes[id];
+        flt node_total = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+        flt r = uniform() * node_total;
+        int i = 0;
+        for (; i < 3; i++) {
+            if (r < node.sum[i])
+                break;
+            r -= node.sum[i];
+        }
+        // Rounding may leave us on an empty quadrant
+        while (node.sum[i] <= 0)
+            i--;
+
+        pdf_square *= 4 * node.sum[i] / node_total;
+        scale *= 0.5f;
+        offset += vec2(i & 1, i >> 1) * scale;
+        if (node.child[i] == 0)
+            break;
+        id = node.child[i];
+    }
+
+    pdf = pdf_square / (4 * PI);
+    return canonical_to_dir(offset + vec2(uniform(), uniform()) * scale);
+}
+
+flt DTree::pdf(const vec3& dir) const
+{
+    if (!(this->total() > 0))
+        return 1.0f / (4 * PI);
+
+    vec2 p = dir_to_canonical(dir);
+    flt pdf_square = 1.0f;
+    int id = 0;
+    while (true) {
+        const Node& node = nodes[id];
+        flt node_total = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+        int i = quadrant(p);
+        if (node.sum[i] <= 0)
+            return 0.0f;
+
+        pdf_square *= 4 * node.sum[i] / node_total;
+        if (node.child[i] == 0)
+            break;
+        p = p * 2.0f - vec2(i & 1, i >> 1);
+        id = node.child[i];
+    }
+    return pdf_square / (4 * PI);
+}
+
+void DTree::record(const vec3& dir, flt value)
+{
+    vec2 p = dir_to_canonical(dir);
+    int id = 0;
+    while (true) {
+        int i = quadrant(p);
+        if (nodes[id].child[i] == 0) {
+#pragma omp atomic
+            nodes[id].sum[i] += value;
+            return;
+        }
+        p = p * 2.0f - vec2(i & 1, i >> 1);
+        id = nodes[id].child[i];
+    }
+}
+
+flt DTree::build_node(int id)
+{
+    for (int i = 0; i < 4; i++) {
+        if (nodes[id].child[i] != 0)
+            nodes[id].sum[i] = build_node(nodes[id].child[i]);
+    }
+    const Node& node = nodes[id];
+    return node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+}
+
+void DTree::build()
+{
+    build_node(0);
+}
+
+void DTree::reset(const DTree& prev, flt threshold)
+{
+    nodes.assign(1, Node());
+    reset_node(0, prev, 0, prev.nodes[0].sum, prev.total(), threshold, 1);
+}
+
+// prev_id is -1 when the previous tree had a leaf here, its energy is then
+// spread evenly over the new quadrants
+void DTree::reset_node(int id, const DTree& prev, int prev_id, const flt* prev_sum, flt total, flt threshold, int depth)
+{
+    for (int i = 0; i < 4; i++) {
+        flt fraction = total > 0 ? prev_sum[i] / total : powf(0.25f, depth);
+        if (depth >= kMaxDTreeDepth || fraction <= threshold)
+            continue;
+
+        int child_prev_id = -1;
+        flt child_sum[4];
+        if (prev_id >= 0 && prev.nodes[prev_id].child[i] != 0) {
+            child_prev_id = prev.nodes[prev_id].child[i];
+            for (int k = 0; k < 4; k++)
+                child_sum[k] = prev.nodes[child_prev_id].sum[k];
+        } else {
+            for (int k = 0; k < 4; k++)
+                child_sum[k] = prev_sum[i] / 4;
+        }
+
+        int child_id = nodes.size();
+        nodes.push_back(Node());
+        nodes[id].child[i] = child_id;
+        reset_node(child_id, prev, child_prev_id, child_sum, total, threshold, depth + 1);
+    }
+}
+
+DTreeWrapper::DTreeWrapper()
+    : sample_count(0)
+{
+}
+
+void DTreeWrapper::record(const vec3& dir, flt value)
+{
+    building.record(dir, value);
+#pragma omp atomic
+    sample_count += 1.0f;
+}
+
+void DTreeWrapper::refresh(flt threshold)
+{
+    building.build();
+    sampling = building;
+    building.reset(sampling, threshold);
+}
+
+STree::STree()
+{
+}
+
+void STree::init(const BBox& scene_box)
+{
+    // A cube slightly larger than the scene, so that splits stay isotropic
+    vec3 center = (scene_box.min_p + scene_box.max_p) * 0.5f;
+    flt extent = glm::compMax(scene_box.max_p - scene_box.min_p) * 0.5f * 1.01f + kHitEps;
+    box = BBox();
+    box.update(center - vec3(extent));
+    box.update(center + vec3(extent));
+
+    Node root = { 0, { 0, 0 }, 0 };
+    nodes.assign(1, root);
+    dtrees.assign(1, DTreeWrapper());
+}
+
+DTreeWrapper* STree::lookup(const vec3& p)
+{
+    vec3 q = (p - box.min_p) / (box.max_p - box.min_p);
+    for (int i = 0; i < 3; i++)
+        q[i] = clamp(q[i], 0.0f, 1.0f);
+
+    int id = 0;
+    while (nodes[id].child[0] != 0) {
+        int axis = nodes[id].axis;
+        if (q[axis] < 0.5f) {
+            q[axis] = q[axis] * 2;
+            id = nodes[id].child[0];
+        } else {
+            q[axis] = q[axis] * 2 - 1;
+            id = nodes[id].child[1];
+        }
+    }
+    return &dtrees[nodes[id].dtree];
+}
+
+void STree::refine(flt threshold)
+{
+    // New children are appended and visited by the same loop
+    for (size_t id = 0; id < nodes.size(); id++) {
+        if (nodes[id].child[0] != 0)
+            continue;
+        int dtree = nodes[id].dtree;
+        if (dtrees[dtree].sample_count <= threshold)
+            continue;
+
+        dtrees[dtree].sample_count *= 0.5f;
+        dtrees.push_back(dtrees[dtree]);
+
+        int axis = (nodes[id].axis + 1) % 3;
+        Node left = { axis, { 0, 0 }, dtree };
+        Node right = { axis, { 0, 0 }, static_cast<int>(dtrees.size()) - 1 };
+        nodes[id].child[0] = nodes.size();
+        nodes[id].child[1] = nodes.size() + 1;
+        nodes.push_back(left);
+        nodes.push_back(right);
+    }
+}
+
+PathGuide::PathGuide()
+    : iteration(0)
+    , training(false)
+    , bsdf_fraction(0.5)
+{
+}
+
+void PathGuide::init(const BBox& box)
+{
+    stree.init(box);
+    iteration = 0;
+    training = true;
+}
+
+void PathGuide::next_iteration()
+{
+    stree.refine(kSpatialThreshold * sqrtf(powf(2.0f, iteration)));
+
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < static_cast<int>(stree.dtrees.size()); i++) {
+        stree.dtrees[i].refresh(kDirectionalThreshold);
+        stree.dtrees[i].sample_count = 0;
+    }
+    iteration++;
+    DEBUGM("guiding iteration %d: %zu spatial leaves\n", iteration, stree.dtrees.size());
+}
+
+void GuideVertex::add(const vec3& contribution)
+{
+    for (int i = 0; i < 3; i++) {
+        if (throughput[i] > 0)
+            radiance[i] += contribution[i] / throughput[i];
+    }
+}
+
+void GuideVertex::commit() const
+{
+    if (!dtree || !(pdf > 0))
+        return;
+    flt value = (radiance[0] + radiance[1] + radiance[2]) / 3.0f / pdf;
+    if (std::isfinite(value) && value >= 0)
+        dtree->record(dir, value);
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <vector>
+
+#include "bbox.hpp"
+#include "global.hpp"
+
+// Practical path guiding
+// Müller et al., "Practical Path Guiding for Efficient Light-Transport Simulation", 2017
+
+// Directional distribution of incident radiance, stored as a quadtree over
+// the cylindrical mapping of the unit sphere
+class DTree {
+public:
+    struct Node {
+        flt sum[4];
+        // 0 means the quadrant is a leaf, the root is never a child
+        int child[4];
+    };
+
+    DTree();
+    vec3 sample(flt& pdf) const;
+    flt pdf(const vec3& dir) const;
+    void record(const vec3& dir, flt value);
+    // Propagate the recorded leaf sums to the interior nodes
+    void build();
+    // Rebuild the structure from a built tree, subdividing the quadrants
+    // holding more than threshold of the energy, with all sums cleared
+    void reset(const DTree& prev, flt threshold);
+    flt total() const;
+
+public:
+    std::vector<Node> nodes;
+
+private:
+    flt build_node(int id);
+    void reset_node(int id, const DTree& prev, int prev_id, const flt* prev_sum, flt total, flt threshold, int depth);
+};
+
+// A distribution being sampled from and the one being learned in the same region
+class DTreeWrapper {
+public:
+    DTreeWrapper();
+    void record(const vec3& dir, flt value);
+    void refresh(flt threshold);
+
+    inline vec3 sample(flt& pdf) const { return sampling.sample(pdf); }
+    inline flt pdf(const vec3& dir) const { return sampling.pdf(dir); }
+
+public:
+    DTree building;
+    DTree sampling;
+    flt sample_count;
+};
+
+// Spatial binary tree over the scene, each leaf holds a DTreeWrapper
+class STree {
+public:
+    struct Node {
+        int axis;
+        // 0 means a leaf
+        int child[2];
+        int dtree;
+    };
+
+    STree();
+    void init(const BBox& box);
+    DTreeWrapper* lookup(const vec3& p);
+    // Split the leaves with more than threshold samples
+    void refine(flt threshold);
+
+public:
+    BBox box;
+    std::vector<Node> nodes;
+    std::vector<DTreeWrapper> dtrees;
+};
+
+class PathGuide {
+public:
+    PathGuide();
+    void init(const BBox& box);
+    // Refine the trees with the statistics of the finished training pass
+    void next_iteration();
+
+    inline DTreeWrapper* lookup(const vec3& p) { return stree.lookup(p); }
+    // The first pass has nothing to sample from yet
+    inline bool ready() const { return iteration > 0; }
+
+public:
+    STree stree;
+    int iteration;
+    bool training;
+    // Probability of sampling the BSDF instead of the guiding distribution
+    flt bsdf_fraction;
+};
+
+// A path vertex collecting the incident radiance along its sampled direction
+struct GuideVertex {
+    DTreeWrapper* dtree;
+    vec3 dir;
+    // Path throughput after scattering at this vertex
+    vec3 throughput;
+    vec3 radiance;
+    flt pdf;
+
+    void add(const vec3& contribution);
+    void commit() const;
+};
+
+const int kMaxGuideVertices = 32;
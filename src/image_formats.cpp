@@ -0,0 +1,247 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "buffer.hpp"
+#include "global.hpp"
+#include "image_formats.hpp"
+
+bool is_image_format(const std::string& extension)
+{
+    return extension == "jpg" || extension == "pfm" || extension == "exr";
+}
+
+std::string with_extension(const std::string& file, const std::string& extension)
+{
+    return file.substr(0, file.find_last_of('.') + 1) + extension;
+}
+
+bool write_image(const std::string& file, const Buffer& buffer, int sample_num)
+{
+    std::string extension = file.substr(file.find_last_of('.') + 1);
+    if (extension == "pfm")
+        return write_pfm(file, buffer, sample_num);
+    if (extension == "exr")
+        return write_exr(file, buffer, sample_num);
+    buffer.to_picture(file, sample_num);
+    return true;
+}
+
+// Divides the components of a row of channel by the samples of its pixels
+static void normalized_row(const Buffer& buffer, int channel, int y, int sample_num, std::vector<float>& out)
+{
+    int components = buffer.components(channel);
+    const flt* p = buffer.row(channel, y);
+    out.resize(static_cast<size_t>(buffer.width) * components);
+    bool counts = channel == buffer.find_channel("samples");
+    for (int x = 0; x < buffer.width; x++) {
+        flt num = counts ? 1 : buffer.tracks_samples() ? buffer.samples(x, y) : sample_num;
+        for (int i = 0; i < components; i++)
+            out[x * components + i] = num > 0 ? p[x * components + i] / num : 0.0f;
+    }
+}
+
+static void put_bytes(std::vector<char>& out, const void* data, size_t size)
+{
+    out.insert(out.end(), static_cast<const char*>(data), static_cast<const char*>(data) + size);
+}
+
+template <typename T>
+static void put(std::vector<char>& out, T v)
+{
+    put_bytes(out, &v, sizeof(v));
+}
+
+static void put_attribute(std::vector<char>& out, const char* name, const char* type, const std::vector<char>& value)
+{
+    put_bytes(out, name, strlen(name) + 1);
+    put_bytes(out, type, strlen(type) + 1);
+    put<int32_t>(out, value.size());
+    put_bytes(out, value.data(), value.size());
+}
+
+MappedImage::MappedImage()
+    : exr(false)
+    , width(0)
+    , height(0)
+    , header_size(0)
+    , row_size(0)
+    , size(0)
+    , fd(-1)
+    , data(NULL)
+{
+}
+
+MappedImage::~MappedImage()
+{
+    close();
+}
+
+// Attributes of an uncompressed single-part scanline file, without the offset table
+void MappedImage::exr_header(std::vector<char>& header) const
+{
+    put<uint32_t>(header, 20000630);
+    put<uint32_t>(header, 2);
+    std::vector<char> value;
+    for (auto& channel : exr_channels) {
+        put_bytes(value, channel.name.c_str(), channel.name.size() + 1);
+        // FLOAT pixels, not perceptually linear, reserved bytes, no subsampling
+        put<int32_t>(value, 2);
+        put<uint32_t>(value, 0);
+        put<int32_t>(value, 1);
+        put<int32_t>(value, 1);
+    }
+    value.push_back(0);
+    put_attribute(header, "channels", "chlist", value);
+    put_attribute(header, "compression", "compression", std::vector<char>(1, 0));
+    value.clear();
+    put<int32_t>(value, 0);
+    put<int32_t>(value, 0);
+    put<int32_t>(value, width - 1);
+    put<int32_t>(value, height - 1);
+    put_attribute(header, "dataWindow", "box2i", value);
+    put_attribute(header, "displayWindow", "box2i", value);
+    put_attribute(header, "lineOrder", "lineOrder", std::vector<char>(1, 0));
+    value.clear();
+    put<float>(value, 1.0f);
+    put_attribute(header, "pixelAspectRatio", "float", value);
+    put_attribute(header, "screenWindowWidth", "float", value);
+    value.clear();
+    put<float>(value, 0.0f);
+    put<float>(value, 0.0f);
+    put_attribute(header, "screenWindowCenter", "v2f", value);
+    header.push_back(0);
+}
+
+// exr rows are blocks of their y, their size and the channels one after another,
+// pfm rows are stored bottom row first
+size_t MappedImage::row_offset(int y) const
+{
+    if (exr)
+        return header_size + static_cast<size_t>(y) * (2 * sizeof(int32_t) + row_size);
+    return header_size + static_cast<size_t>(height - 1 - y) * row_size;
+}
+
+bool MappedImage::open(const std::string& file, int width, int height, const Buffer& layout)
+{
+    close();
+    this->file = file;
+    this->width = width;
+    this->height = height;
+    exr = file.substr(file.find_last_of('.') + 1) == "exr";
+
+    std::vector<char> header;
+    exr_channels.clear();
+    if (exr) {
+        // The channels of a file are sorted by name
+        const char* rgb[3] = { "R", "G", "B" };
+        for (int c = 0; c < layout.num_channels(); c++) {
+            int components = layout.components(c);
+            for (int i = 0; i < components; i++) {
+                std::string name = c == Buffer::kRadiance ? "" : layout.channel_name(c);
+                if (components == 3)
+                    name += (name.empty() ? "" : ".") + std::string(rgb[i]);
+                else if (components > 1)
+                    name += "." + std::to_string(i);
+                ExrChannel channel = { name, c, i };
+                exr_channels.push_back(channel);
+            }
+        }
+        std::sort(exr_channels.begin(), exr_channels.end());
+        exr_header(header);
+        row_size = static_cast<size_t>(width) * exr_channels.size() * sizeof(float);
+        header_size = header.size() + static_cast<size_t>(height) * sizeof(uint64_t);
+        for (int y = 0; y < height; y++)
+            put<uint64_t>(header, row_offset(y));
+    } else {
+        char text[64];
+        // A negative scale marks little-endian floats
+        snprintf(text, sizeof(text), "PF\n%d %d\n-1.0\n", width, height);
+        put_bytes(header, text, strlen(text));
+        row_size = static_cast<size_t>(width) * 3 * sizeof(float);
+        header_size = header.size();
+    }
+    size = exr ? row_offset(height) : header_size + static_cast<size_t>(height) * row_size;
+
+    fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    if (ftruncate(fd, size) != 0 || pwrite(fd, header.data(), header.size(), 0) != static_cast<ssize_t>(header.size())) {
+        close();
+        return false;
+    }
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        close();
+        return false;
+    }
+    data = static_cast<char*>(p);
+    return true;
+}
+
+bool MappedImage::write_rows(const Buffer& buffer, int y0, int sample_num)
+{
+    if (!data || buffer.width != width || y0 < 0 || y0 + buffer.height > height)
+        return false;
+    std::vector<std::vector<float>> rows(buffer.num_channels());
+    for (int y = 0; y < buffer.height; y++) {
+        char* p = data + row_offset(y0 + y);
+        if (exr) {
+            int32_t block[2] = { y0 + y, static_cast<int32_t>(row_size) };
+            memcpy(p, block, sizeof(block));
+            float* line = reinterpret_cast<float*>(p + sizeof(block));
+            for (int c = 0; c < buffer.num_channels(); c++)
+                normalized_row(buffer, c, y, sample_num, rows[c]);
+            for (auto& channel : exr_channels) {
+                int components = buffer.components(channel.channel);
+                for (int x = 0; x < width; x++)
+                    line[x] = rows[channel.channel][x * components + channel.component];
+                line += width;
+            }
+        } else {
+            normalized_row(buffer, Buffer::kRadiance, y, sample_num, rows[0]);
+            memcpy(p, rows[0].data(), row_size);
+        }
+    }
+
+    // The rows are flushed and their pages given back, pfm rows go downwards in the file
+    size_t first = row_offset(exr ? y0 : y0 + buffer.height - 1);
+    size_t last = exr ? row_offset(y0 + buffer.height) : row_offset(y0) + row_size;
+    size_t page = sysconf(_SC_PAGESIZE);
+    first = first / page * page;
+    if (msync(data + first, last - first, MS_SYNC) != 0)
+        return false;
+    madvise(data + first, last - first, MADV_DONTNEED);
+    return true;
+}
+
+bool MappedImage::close()
+{
+    bool ok = true;
+    if (data)
+        ok = munmap(data, size) == 0;
+    if (fd >= 0)
+        ok = ::close(fd) == 0 && ok;
+    data = NULL;
+    fd = -1;
+    return ok;
+}
+
+bool write_pfm(const std::string& file, const Buffer& buffer, int sample_num)
+{
+    MappedImage image;
+    return image.open(file, buffer.width, buffer.height, buffer) && image.write_rows(buffer, 0, sample_num) && image.close();
+}
+
+bool write_exr(const std::string& file, const Buffer& buffer, int sample_num)
+{
+    MappedImage image;
+    return image.open(file, buffer.width, buffer.height, buffer) && image.write_rows(buffer, 0, sample_num) && image.close();
+}
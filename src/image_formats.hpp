@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "buffer.hpp"
+#include "global.hpp"
+
+// Extensions write_image knows
+bool is_image_format(const std::string& extension);
+// dir/name.jpg with another extension
+std::string with_extension(const std::string& file, const std::string& extension);
+
+// Writes buffer divided by sample_num, or by the per-pixel sample counts when the
+// buffer tracks them, in the format of the extension of file. jpg is tonemapped,
+// pfm and exr keep the linear floats. Rows are converted one at a time.
+bool write_image(const std::string& file, const Buffer& buffer, int sample_num);
+
+// A pfm or exr file of known size mapped into memory, so that rows are written in
+// any order. Written rows are flushed to the file and dropped from memory, only the
+// rows being written take memory.
+class MappedImage {
+public:
+    MappedImage();
+    MappedImage(const MappedImage&) = delete;
+    MappedImage& operator=(const MappedImage&) = delete;
+    ~MappedImage();
+
+    // Creates file for an image of width x height with the channels of layout
+    bool open(const std::string& file, int width, int height, const Buffer& layout);
+    // Writes the rows of buffer divided by sample_num as write_image does, row y of
+    // buffer is row y0 + y of the image
+    bool write_rows(const Buffer& buffer, int y0, int sample_num);
+    bool close();
+
+private:
+    // One channel of an exr file, taken from a component of a framebuffer channel
+    struct ExrChannel {
+        std::string name;
+        int channel;
+        int component;
+
+        bool operator<(const ExrChannel& other) const { return name < other.name; }
+    };
+    void exr_header(std::vector<char>& header) const;
+    size_t row_offset(int y) const;
+
+    std::string file;
+    bool exr;
+    int width, height;
+    std::vector<ExrChannel> exr_channels;
+    size_t header_size;
+    size_t row_size;
+    size_t size;
+    int fd;
+    char* data;
+};
+
+// Radiance only, bottom row first as the format wants
+bool write_pfm(const std::string& file, const Buffer& buffer, int sample_num);
+// Uncompressed scanline OpenEXR of all the channels as 32-bit floats. Radiance is
+// R, G, B, other channels are name or name.R, name.G, name.B, the sample counts
+// are written as they are.
+bool write_exr(const std::string& file, const Buffer& buffer, int sample_num);
@@ -0,0 +1,89 @@
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "buffer.hpp"
+#include "checkpoint.hpp"
+#include "global.hpp"
+#include "image_formats.hpp"
+#include "image_writer.hpp"
+
+ImageWriter::ImageWriter()
+    : busy(false)
+    , stop(false)
+{
+    thread = std::thread(&ImageWriter::run, this);
+}
+
+ImageWriter::~ImageWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    wake.notify_one();
+    thread.join();
+}
+
+void ImageWriter::write(const Buffer& buffer, const std::string& file, int sample_num, bool progress)
+{
+    Job job = { buffer, file, sample_num, progress, false, CheckpointInfo() };
+    push(std::move(job));
+}
+
+void ImageWriter::checkpoint(const Buffer& buffer, const std::string& file, const CheckpointInfo& info)
+{
+    Job job = { buffer, file, info.rendered, true, true, info };
+    push(std::move(job));
+}
+
+void ImageWriter::push(Job job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (job.progress) {
+            for (auto it = jobs.begin(); it != jobs.end(); ++it) {
+                if (it->progress && it->file == job.file) {
+                    jobs.erase(it);
+                    break;
+                }
+            }
+        }
+        jobs.push_back(std::move(job));
+    }
+    wake.notify_one();
+}
+
+void ImageWriter::flush()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this] { return jobs.empty() && !busy; });
+}
+
+void ImageWriter::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [this] { return stop || !jobs.empty(); });
+        if (jobs.empty())
+            break;
+        Job job = std::move(jobs.front());
+        jobs.pop_front();
+        busy = true;
+        lock.unlock();
+
+        if (!job.checkpoint)
+            write_image(job.file, job.buffer, job.sample_num);
+        else if (!save_checkpoint(job.file, job.buffer, job.info))
+            INFO("Cannot write the checkpoint %s\n", job.file.c_str());
+        DEBUGM("wrote %s at %d samples\n", job.file.c_str(), job.sample_num);
+
+        lock.lock();
+        busy = false;
+        if (jobs.empty())
+            idle.notify_all();
+    }
+}
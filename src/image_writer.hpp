@@ -0,0 +1,48 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "buffer.hpp"
+#include "checkpoint.hpp"
+#include "global.hpp"
+
+// Tonemaps and encodes copies of the framebuffer on a background thread, so that
+// rendering goes on while an image is written
+class ImageWriter {
+public:
+    ImageWriter();
+    // Writes the queued images before returning
+    ~ImageWriter();
+
+    // Queues buffer divided by sample_num for file. A queued progress image of
+    // the same file is replaced, as only the latest one matters.
+    void write(const Buffer& buffer, const std::string& file, int sample_num, bool progress = false);
+    // Queues a checkpoint of buffer, replacing a queued checkpoint of the same file
+    void checkpoint(const Buffer& buffer, const std::string& file, const CheckpointInfo& info);
+    // Waits for the queued images
+    void flush();
+
+private:
+    struct Job {
+        Buffer buffer;
+        std::string file;
+        int sample_num;
+        bool progress;
+        bool checkpoint;
+        CheckpointInfo info;
+    };
+    void push(Job job);
+    void run();
+
+    std::deque<Job> jobs;
+    bool busy;
+    bool stop;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::thread thread;
+};
@@ -0,0 +1,362 @@
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <string>
+
+#include <omp.h>
+
+#include "glm/glm.hpp"
+
+#include "bdpt.hpp"
+#include "global.hpp"
+#include "integrator.hpp"
+#include "material.hpp"
+#include "mlt.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+#include "tiles.hpp"
+
+// Initial caustic gather radius relative to the scene diagonal
+const flt kCausticRadiusScale = 0.003;
+// Default radiance cache cell size relative to the scene diagonal
+const flt kCacheCellScale = 0.02;
+// Light cache cell size relative to the scene diagonal
+const flt kLightCacheCellScale = 0.05;
+// Default ambient occlusion radius relative to the scene diagonal
+const flt kAORadiusScale = 0.1;
+// Glass surfaces followed by the preview integrators before giving up
+const int kMaxSpecularDepth = 8;
+
+static flt scene_diagonal(Scene& scene)
+{
+    BBox box;
+    scene.bvh_root->bounding_box(box);
+    return glm::length(box.max_p - box.min_p);
+}
+
+// Emission a ray sees up to its hit, of quad lights, the environment and emissive triangles
+static vec3 seen_emission(Scene& scene, const Ray& ray, bool hit, const HitRecord& rec)
+{
+    vec3 L(0.0f), emissive_color;
+    if (!scene.egroup.quads.empty())
+        L += scene.egroup.emission(ray, hit ? rec.t : INFINITY);
+    if (!hit && scene.egroup.envmap)
+        L += scene.egroup.envmap->Le(ray.direction);
+    if (hit && rec.mat->type(emissive_color) == Material::LIGHT && glm::dot(rec.normal, ray.direction) < 0)
+        L += emissive_color;
+    return L;
+}
+
+int Integrator::render_samples(Scene& scene, int first_sample, int count)
+{
+    for (int i = 0; i < count; i++) {
+        if (scene.out_of_time())
+            return i;
+        render_sample(scene, first_sample + i);
+    }
+    return count;
+}
+
+void PixelIntegrator::add_sample(Scene& scene, Sampler& sampler, int x, int y, int now_sample)
+{
+    // Pixels ahead of the others in a resumed render already have this sample
+    if (scene.buffer.tracks_samples() && scene.buffer.samples(x, y) > now_sample - scene.first_sample)
+        return;
+    // The sequences belong to the pixels of the camera image, a part of the image renders as in the whole
+    int pixel_x = x + scene.buffer.x0, pixel_y = y + scene.buffer.y0;
+    sampler.start_pixel(pixel_x, pixel_y, now_sample - 1);
+    vec3 light = sample(scene, pixel_x, pixel_y, now_sample);
+
+    if (std::isfinite(light[0]) && std::isfinite(light[1]) && std::isfinite(light[2])) {
+        scene.buffer.add_sample(x, y, light);
+    } else {
+        DEBUGM("Not finite number at sample %d x %d y %d\n", now_sample, x, y);
+        // Counted as black, so that the sample counts of the pixels stay exact
+        light = vec3(0.0f);
+        scene.buffer.add_sample(x, y, light);
+    }
+    if (scene.features.enabled())
+        add_features(scene, sampler, x, y, now_sample, light);
+}
+
+// Starting the sequence of the pixel again gives the camera ray of the radiance
+// sample, so that the emission seen directly is the one in the sample
+void PixelIntegrator::add_features(Scene& scene, Sampler& sampler, int x, int y, int now_sample, const vec3& light)
+{
+    const FeatureChannels& features = scene.features;
+    Buffer& buffer = scene.buffer;
+    sampler.start_pixel(x + buffer.x0, y + buffer.y0, now_sample - 1);
+    Ray ray = scene.camera.cast_ray(x + buffer.x0, y + buffer.y0);
+
+    HitRecord rec;
+    vec3 throughput(1.0f), emission(0.0f), emissive_color, wi;
+    flt distance = 0;
+    bool hit = false;
+    for (int depth = 0; depth < kMaxSpecularDepth; depth++) {
+        hit = scene.bvh_root->hit(ray, vec2(kHitEps, INFINITY), rec);
+        if (adds_emission())
+            emission += throughput * seen_emission(scene, ray, hit, rec);
+        if (!hit)
+            break;
+        distance += rec.t;
+        if (rec.mat->type(emissive_color) != Material::GLASS)
+            break;
+        rec.mat->scatter(-ray.direction, rec, wi);
+        throughput *= rec.mat->bsdf(-ray.direction, wi, rec);
+        ray = Ray(rec.p, wi);
+        hit = false;
+    }
+
+    flt rest = luminance(light - emission);
+    *buffer.at(features.luminance2, x, y) += rest * rest;
+    flt* e = buffer.at(features.emission, x, y);
+    for (int i = 0; i < 3; i++)
+        e[i] += emission[i];
+    if (!hit)
+        return;
+    vec3 albedo = throughput * rec.mat->albedo(rec);
+    vec3 normal = glm::dot(rec.normal, ray.direction) < 0 ? rec.normal : -rec.normal;
+    flt* a = buffer.at(features.albedo, x, y);
+    flt* n = buffer.at(features.normal, x, y);
+    for (int i = 0; i < 3; i++) {
+        a[i] += albedo[i];
+        n[i] += normal[i];
+    }
+    *buffer.at(features.depth, x, y) += distance;
+}
+
+void PixelIntegrator::render_sample(Scene& scene, int now_sample)
+{
+    begin_sample(scene, now_sample);
+
+    Buffer& buffer = scene.buffer;
+#pragma omp parallel
+    {
+        std::unique_ptr<Sampler> sampler = create_sampler(scene.options);
+        ScopedSampler scoped(*sampler);
+#pragma omp for schedule(dynamic)
+        for (int y_t = 0; y_t < buffer.height; y_t++) {
+            for (int x_t = 0; x_t < buffer.width; x_t++)
+                add_sample(scene, *sampler, x_t, y_t, now_sample);
+        }
+    }
+}
+
+int PixelIntegrator::render_samples(Scene& scene, int first_sample, int count)
+{
+    if (scene.options.tile_size <= 0 || needs_passes(scene))
+        return Integrator::render_samples(scene, first_sample, count);
+    if (scene.out_of_time())
+        return 0;
+    begin_sample(scene, first_sample);
+
+    Buffer& buffer = scene.buffer;
+    TileScheduler scheduler(buffer.width, buffer.height, scene.options.tile_size, omp_get_max_threads());
+    // Past the deadline every tile still gets its first sample, the later samples
+    // are cut short. Only the samples all the tiles finished are reported.
+    int completed = count;
+#pragma omp parallel reduction(min : completed)
+    {
+        std::unique_ptr<Sampler> sampler = create_sampler(scene.options);
+        ScopedSampler scoped(*sampler);
+        Tile tile;
+        while (scheduler.next(omp_get_thread_num(), tile)) {
+            int now_sample = first_sample;
+            for (; now_sample < first_sample + count; now_sample++) {
+                if (now_sample > first_sample && scene.out_of_time())
+                    break;
+                for (int y_t = tile.y0; y_t < tile.y1; y_t++) {
+                    for (int x_t = tile.x0; x_t < tile.x1; x_t++)
+                        add_sample(scene, *sampler, x_t, y_t, now_sample);
+                }
+            }
+            completed = std::min(completed, now_sample - first_sample);
+        }
+    }
+    return completed;
+}
+
+PathIntegrator::PathIntegrator(int max_depth)
+    : max_depth(max_depth)
+{
+}
+
+void PathIntegrator::init(Scene& scene)
+{
+    const RenderOptions& options = scene.options;
+    scene.max_depth = max_depth;
+    if (options.caustic_photons > 0) {
+        flt radius = options.caustic_radius > 0 ? options.caustic_radius : kCausticRadiusScale * scene_diagonal(scene);
+        scene.caustics.init(scene.egroup, radius, options.caustic_photons);
+    }
+    if (options.radiance_cache || options.adaptive_rr) {
+        flt cell_size = options.cache_cell > 0 ? options.cache_cell : kCacheCellScale * scene_diagonal(scene);
+        scene.cache.init(cell_size, options.cache_error);
+    }
+    if (options.restir) {
+        scene.restir.init(scene);
+    }
+    if (options.light_cache && !scene.egroup.emissive_list.empty()) {
+        scene.light_cache.init(scene.egroup.emissive_list, scene.egroup.sample_sum, kLightCacheCellScale * scene_diagonal(scene));
+        scene.egroup.light_cache = &scene.light_cache;
+    }
+}
+
+// Caustic photons and reservoirs are renewed for every sample
+bool PathIntegrator::needs_passes(const Scene& scene) const
+{
+    return scene.options.caustic_photons > 0 || scene.options.restir;
+}
+
+void PathIntegrator::begin_sample(Scene& scene, int now_sample)
+{
+    if (scene.options.caustic_photons > 0)
+        scene.caustics.next_pass(scene.bvh_root, now_sample);
+    if (scene.options.restir)
+        scene.restir.next_pass(scene, now_sample);
+    if (scene.egroup.light_cache)
+        scene.light_cache.update();
+}
+
+vec3 PathIntegrator::sample(Scene& scene, int x, int y, int now_sample)
+{
+    // Mean of the samples so far, parts of a distributed render start from none
+    const Buffer& buffer = scene.buffer;
+    flt num = buffer.samples(x - buffer.x0, y - buffer.y0);
+    flt pixel_estimate = num > 0 ? luminance(buffer.get(x - buffer.x0, y - buffer.y0)) / num : 0;
+    if (scene.options.restir)
+        return scene.Li(scene.restir.ray(x, y), scene.bvh_root, scene.restir.direct(x, y), pixel_estimate);
+    return scene.Li(scene.camera.cast_ray(x, y), scene.bvh_root, NULL, pixel_estimate);
+}
+
+vec3 DirectIntegrator::sample(Scene& scene, int x, int y, int now_sample)
+{
+    // Emission is added along the specular chain of the camera ray, as the path integrator does
+    Ray ray = scene.camera.cast_ray(x, y);
+    HitRecord rec;
+    vec3 color(0.0f), throughput(1.0f), emissive_color, wi;
+    for (int depth = 0; depth < kMaxSpecularDepth; depth++) {
+        bool hit = scene.bvh_root->hit(ray, vec2(kHitEps, INFINITY), rec);
+        color += throughput * seen_emission(scene, ray, hit, rec);
+        if (!hit || rec.mat->type(emissive_color) == Material::LIGHT)
+            return color;
+
+        vec3 wo = -ray.direction;
+        if (rec.mat->type(emissive_color) != Material::GLASS) {
+            rec.normal = glm::dot(rec.normal, wo) > 0 ? rec.normal : -rec.normal;
+            return color + throughput * scene.sample_light(rec, wo, scene.bvh_root);
+        }
+        rec.mat->scatter(wo, rec, wi);
+        throughput *= rec.mat->bsdf(wo, wi, rec);
+        ray = Ray(rec.p, wi);
+    }
+    return color;
+}
+
+AOIntegrator::AOIntegrator(flt radius)
+    : radius(radius)
+{
+}
+
+void AOIntegrator::init(Scene& scene)
+{
+    if (!(radius > 0))
+        radius = kAORadiusScale * scene_diagonal(scene);
+}
+
+vec3 AOIntegrator::sample(Scene& scene, int x, int y, int now_sample)
+{
+    Ray ray = scene.camera.cast_ray(x, y);
+    HitRecord rec;
+    if (!scene.bvh_root->hit(ray, vec2(kHitEps, INFINITY), rec))
+        return vec3(0.0f);
+
+    rec.normal = glm::dot(rec.normal, ray.direction) < 0 ? rec.normal : -rec.normal;
+    flt cos_theta = sqrtf(1.0f - uniform());
+    flt phi = uniform(0, 2 * PI);
+    vec3 wi = to_world(angle_to_cartesian(cos_theta, phi), rec.normal);
+
+    HitRecord occluder;
+    return scene.bvh_root->hit(Ray(rec.p, wi), vec2(kHitEps, radius), occluder) ? vec3(0.0f) : vec3(1.0f);
+}
+
+vec3 AlbedoIntegrator::sample(Scene& scene, int x, int y, int now_sample)
+{
+    HitRecord rec;
+    if (!scene.bvh_root->hit(scene.camera.cast_ray(x, y), vec2(kHitEps, INFINITY), rec))
+        return vec3(0.0f);
+    return rec.mat->albedo(rec);
+}
+
+vec3 NormalIntegrator::sample(Scene& scene, int x, int y, int now_sample)
+{
+    HitRecord rec;
+    if (!scene.bvh_root->hit(scene.camera.cast_ray(x, y), vec2(kHitEps, INFINITY), rec))
+        return vec3(0.0f);
+    return 0.5f * (rec.normal + vec3(1.0f));
+}
+
+static Integrator* make_path(const RenderOptions& options)
+{
+    return new PathIntegrator(0);
+}
+
+static Integrator* make_depth(const RenderOptions& options)
+{
+    return new PathIntegrator(options.max_depth);
+}
+
+static Integrator* make_direct(const RenderOptions& options)
+{
+    return new DirectIntegrator();
+}
+
+static Integrator* make_ao(const RenderOptions& options)
+{
+    return new AOIntegrator(options.ao_radius);
+}
+
+static Integrator* make_albedo(const RenderOptions& options)
+{
+    return new AlbedoIntegrator();
+}
+
+static Integrator* make_normal(const RenderOptions& options)
+{
+    return new NormalIntegrator();
+}
+
+static Integrator* make_bdpt(const RenderOptions& options)
+{
+    return new BDPT();
+}
+
+static Integrator* make_mlt(const RenderOptions& options)
+{
+    return new MLT(options.mlt_bootstrap, options.mlt_chains);
+}
+
+const std::map<std::string, IntegratorFactory>& integrator_registry()
+{
+    static const std::map<std::string, IntegratorFactory> registry = {
+        { "path", make_path },
+        { "depth", make_depth },
+        { "direct", make_direct },
+        { "ao", make_ao },
+        { "albedo", make_albedo },
+        { "normal", make_normal },
+        { "bdpt", make_bdpt },
+        { "mlt", make_mlt },
+    };
+    return registry;
+}
+
+std::unique_ptr<Integrator> create_integrator(const RenderOptions& options)
+{
+    auto it = integrator_registry().find(options.integrator);
+    if (it == integrator_registry().end())
+        ERRORM("Unknown integrator %s\n", options.integrator.c_str());
+    return std::unique_ptr<Integrator>(it->second(options));
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+
+#include "global.hpp"
+#include "options.hpp"
+
+class Sampler;
+class Scene;
+
+// Renders one sample per pixel into the framebuffer of the scene per call
+class Integrator {
+public:
+    virtual ~Integrator() { }
+    // Called once before the first sample
+    virtual void init(Scene& scene) { }
+    virtual void render_sample(Scene& scene, int now_sample) = 0;
+    // Samples first_sample to first_sample + count - 1, by default one render_sample each.
+    // Stops early at the deadline of the scene and returns the samples every pixel
+    // has, pixels tracked by the framebuffer may have more.
+    virtual int render_samples(Scene& scene, int first_sample, int count);
+};
+
+// Integrators estimating every pixel independently. Several samples at once are
+// rendered tile by tile, each tile taking all of them before the next one.
+class PixelIntegrator : public Integrator {
+public:
+    virtual void render_sample(Scene& scene, int now_sample) override;
+    virtual int render_samples(Scene& scene, int first_sample, int count) override;
+
+protected:
+    // Called before each pass over the pixels, a pass covers all the samples
+    // of a render_samples call in tile mode
+    virtual void begin_sample(Scene& scene, int now_sample) { }
+    // Whether begin_sample is needed before every single sample
+    virtual bool needs_passes(const Scene& scene) const { return false; }
+    // Pixel (x, y) of the camera image, the framebuffer may cover a part of it
+    virtual vec3 sample(Scene& scene, int x, int y, int now_sample) = 0;
+    // Whether samples include the emission seen from the camera, directly or through glass
+    virtual bool adds_emission() const { return false; }
+
+private:
+    void add_sample(Scene& scene, Sampler& sampler, int x, int y, int now_sample);
+    void add_features(Scene& scene, Sampler& sampler, int x, int y, int now_sample, const vec3& light);
+};
+
+// Scene::Li, optionally stopping after max_depth vertices
+class PathIntegrator : public PixelIntegrator {
+public:
+    PathIntegrator(int max_depth);
+    virtual void init(Scene& scene) override;
+
+protected:
+    virtual void begin_sample(Scene& scene, int now_sample) override;
+    virtual bool needs_passes(const Scene& scene) const override;
+    virtual vec3 sample(Scene& scene, int x, int y, int now_sample) override;
+    virtual bool adds_emission() const override { return true; }
+
+public:
+    int max_depth;
+};
+
+// Emission and one light sample at the first diffuse vertex, seen through glass
+class DirectIntegrator : public PixelIntegrator {
+protected:
+    virtual vec3 sample(Scene& scene, int x, int y, int now_sample) override;
+    virtual bool adds_emission() const override { return true; }
+};
+
+// Fraction of the cosine weighted hemisphere unoccluded within radius
+class AOIntegrator : public PixelIntegrator {
+public:
+    AOIntegrator(flt radius);
+    virtual void init(Scene& scene) override;
+
+protected:
+    virtual vec3 sample(Scene& scene, int x, int y, int now_sample) override;
+
+public:
+    flt radius;
+};
+
+// Diffuse reflectance of the first hit
+class AlbedoIntegrator : public PixelIntegrator {
+protected:
+    virtual vec3 sample(Scene& scene, int x, int y, int now_sample) override;
+};
+
+// Shading normal of the first hit mapped to [0, 1]
+class NormalIntegrator : public PixelIntegrator {
+protected:
+    virtual vec3 sample(Scene& scene, int x, int y, int now_sample) override;
+};
+
+typedef Integrator* (*IntegratorFactory)(const RenderOptions& options);
+
+// Integrators selectable with --integrator
+const std::map<std::string, IntegratorFactory>& integrator_registry();
+std::unique_ptr<Integrator> create_integrator(const RenderOptions& options);
@@ -0,0 +1,210 @@
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "bbox.hpp"
+#include "envmap.hpp"
+#include "global.hpp"
+#include "light_cache.hpp"
+#include "lights.hpp"
+#include "object.hpp"
+
+const int kLightCacheTableBits = 14;
+const int kLightCacheMaxProbe = 32;
+const int kMaxLightClusters = 32;
+// Share of the default selection probabilities, keeps the estimator unbiased
+const flt kLightCacheMinFraction = 0.1;
+// Light samples of a cell before its learned probabilities are used
+const flt kLightCacheMinSamples = 8;
+
+// Representative position of an emitter, false for the environment
+static bool emitter_position(const Emissive* emi, vec3& p)
+{
+    if (auto tri = dynamic_cast<const Triangle*>(emi)) {
+        p = (tri->p[0] + tri->p[1] + tri->p[2]) / 3.0f;
+        return true;
+    }
+    if (auto quad = dynamic_cast<const QuadLight*>(emi)) {
+        p = quad->corner + 0.5f * (quad->u + quad->v);
+        return true;
+    }
+    if (auto point = dynamic_cast<const PointLight*>(emi)) {
+        p = point->position;
+        return true;
+    }
+    return false;
+}
+
+// Interleave the lower 10 bits of x, y and z
+static unsigned int morton_code(const ivec3& c)
+{
+    unsigned int code = 0;
+    for (int bit = 0; bit < 10; bit++) {
+        for (int axis = 0; axis < 3; axis++)
+            code |= ((static_cast<unsigned int>(c[axis]) >> bit) & 1u) << (3 * bit + axis);
+    }
+    return code;
+}
+
+LightCache::LightCache()
+    : cell_size(1)
+    , num_cluster(0)
+{
+}
+
+// Lights are sorted along a Morton curve and cut into clusters of equal size,
+// the environment has a cluster of its own
+void LightCache::init(const std::vector<Emissive*>& emissive_list, const std::vector<flt>& sample_sum, flt size)
+{
+    cell_size = size;
+    int n = emissive_list.size();
+
+    std::vector<int> placed, unplaced;
+    std::vector<vec3> position(n);
+    BBox box;
+    for (int i = 0; i < n; i++) {
+        if (emitter_position(emissive_list[i], position[i])) {
+            placed.push_back(i);
+            box.update(position[i]);
+        } else {
+            unplaced.push_back(i);
+        }
+    }
+    vec3 extent = glm::max(box.max_p - box.min_p, vec3(kEps));
+    std::vector<unsigned int> code(n, 0);
+    for (int id : placed) {
+        vec3 t = (position[id] - box.min_p) / extent;
+        ivec3 c;
+        for (int axis = 0; axis < 3; axis++)
+            c[axis] = std::min(std::max(static_cast<int>(t[axis] * 1023.0f), 0), 1023);
+        code[id] = morton_code(c);
+    }
+    std::sort(placed.begin(), placed.end(), [&](int a, int b) { return code[a] < code[b]; });
+
+    int num_placed_cluster = std::min(kMaxLightClusters, static_cast<int>(placed.size()));
+    cluster_ids.assign(num_placed_cluster, std::vector<int>());
+    for (int i = 0; i < static_cast<int>(placed.size()); i++)
+        cluster_ids[static_cast<long long>(i) * num_placed_cluster / placed.size()].push_back(placed[i]);
+    for (int id : unplaced)
+        cluster_ids.push_back(std::vector<int>(1, id));
+    num_cluster = cluster_ids.size();
+
+    // Default weights of the emitters are the ones of the emissive group
+    flt total = sample_sum.back();
+    cluster_of.assign(n, 0);
+    within.assign(n, 0.0f);
+    prior.assign(num_cluster, 0.0f);
+    cluster_sum.assign(num_cluster, std::vector<flt>());
+    for (int c = 0; c < num_cluster; c++) {
+        flt sum = 0.0f;
+        for (int id : cluster_ids[c]) {
+            sum += id == 0 ? sample_sum[0] : sample_sum[id] - sample_sum[id - 1];
+            cluster_sum[c].push_back(sum);
+            cluster_of[id] = c;
+        }
+        for (int id : cluster_ids[c])
+            within[id] = (id == 0 ? sample_sum[0] : sample_sum[id] - sample_sum[id - 1]) / sum;
+        prior[c] = sum / total;
+    }
+
+    size_t table_size = size_t(1) << kLightCacheTableBits;
+    std::vector<std::atomic<unsigned long long>> empty_keys(table_size);
+    for (auto& key : empty_keys)
+        key.store(0);
+    keys.swap(empty_keys);
+    value_sum.assign(table_size * num_cluster, 0.0f);
+    count.assign(table_size * num_cluster, 0.0f);
+    prob.assign(table_size * num_cluster, 0.0f);
+    ready.assign(table_size, 0);
+    DEBUGM("light cache: %d clusters, cell size %f\n", num_cluster, cell_size);
+}
+
+int LightCache::cell(const vec3& p)
+{
+    // 20 bits per coordinate, the top bit marks a used key
+    unsigned long long key = 1ull << 63;
+    for (int i = 0; i < 3; i++) {
+        long long c = static_cast<long long>(floorf(p[i] / cell_size)) & 0xfffff;
+        key |= static_cast<unsigned long long>(c) << (20 * i);
+    }
+
+    unsigned long long h = key * 0x9e3779b97f4a7c15ull;
+    size_t mask = keys.size() - 1;
+    for (int probe = 0; probe < kLightCacheMaxProbe; probe++) {
+        size_t id = ((h >> (64 - kLightCacheTableBits)) + probe) & mask;
+        unsigned long long expected = 0;
+        if (keys[id].load() == key || keys[id].compare_exchange_strong(expected, key) || expected == key)
+            return id;
+    }
+    return -1;
+}
+
+flt LightCache::cluster_pdf(int cell, int cluster) const
+{
+    if (cell < 0 || !ready[cell])
+        return prior[cluster];
+    return prob[cell * num_cluster + cluster];
+}
+
+int LightCache::sample(int cell, flt& pdf) const
+{
+    flt a = uniform();
+    int c = 0;
+    for (; c < num_cluster - 1; c++) {
+        a -= cluster_pdf(cell, c);
+        if (a < 0)
+            break;
+    }
+
+    const std::vector<flt>& sum = cluster_sum[c];
+    int i = std::lower_bound(sum.begin(), sum.end(), uniform() * sum.back()) - sum.begin();
+    int id = cluster_ids[c][std::min(i, static_cast<int>(sum.size()) - 1)];
+    pdf = cluster_pdf(cell, c) * within[id];
+    return id;
+}
+
+flt LightCache::pdf(int cell, int id) const
+{
+    return cluster_pdf(cell, cluster_of[id]) * within[id];
+}
+
+void LightCache::record(int cell, int id, flt value)
+{
+    if (cell < 0 || !std::isfinite(value))
+        return;
+    int i = cell * num_cluster + cluster_of[id];
+    value /= within[id];
+#pragma omp atomic
+    value_sum[i] += value;
+#pragma omp atomic
+    count[i] += 1.0f;
+}
+
+void LightCache::update()
+{
+    for (int cell = 0; cell < static_cast<int>(keys.size()); cell++) {
+        if (keys[cell].load() == 0)
+            continue;
+
+        flt total = 0.0f, samples = 0.0f;
+        for (int c = 0; c < num_cluster; c++) {
+            int i = cell * num_cluster + c;
+            samples += count[i];
+            if (count[i] > 0)
+                total += value_sum[i] / count[i];
+        }
+        if (samples < kLightCacheMinSamples || !(total > 0))
+            continue;
+
+        for (int c = 0; c < num_cluster; c++) {
+            int i = cell * num_cluster + c;
+            flt learned = count[i] > 0 ? value_sum[i] / count[i] / total : 0.0f;
+            prob[i] = kLightCacheMinFraction * prior[c] + (1.0f - kLightCacheMinFraction) * learned;
+        }
+        ready[cell] = 1;
+    }
+}
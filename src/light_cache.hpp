@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+#include "global.hpp"
+#include "object.hpp"
+
+// Hash grid over shading positions learning how much each cluster of lights
+// contributes to a cell, occlusion included. Light selection follows the learned
+// contributions, mixed with the default selection probabilities so that every
+// light keeps a minimum probability. What is learned during a pass is only used
+// from the next update on, so the sampling and MIS pdfs always agree.
+class LightCache {
+public:
+    LightCache();
+    void init(const std::vector<Emissive*>& emissive_list, const std::vector<flt>& sample_sum, flt cell_size);
+    // Cell of a shading position, -1 when the table is full
+    int cell(const vec3& p);
+    // Pick an emitter, returns its index in the emissive list and its selection probability
+    int sample(int cell, flt& pdf) const;
+    flt pdf(int cell, int id) const;
+    // Contribution of a light sample of emitter id, 0 when it is occluded
+    void record(int cell, int id, flt value);
+    // Rebuild the selection probabilities from what was learned so far
+    void update();
+
+public:
+    flt cell_size;
+    int num_cluster;
+
+private:
+    flt cluster_pdf(int cell, int cluster) const;
+
+    // Emitters of every cluster with their cumulative default weights
+    std::vector<std::vector<int>> cluster_ids;
+    std::vector<std::vector<flt>> cluster_sum;
+    std::vector<int> cluster_of;
+    // Probability of an emitter inside its cluster
+    std::vector<flt> within;
+    // Default probability of every cluster
+    std::vector<flt> prior;
+
+    std::vector<std::atomic<unsigned long long>> keys;
+    // num_cluster entries per cell
+    std::vector<flt> value_sum;
+    std::vector<flt> count;
+    std::vector<flt> prob;
+    std::vector<char> ready;
+};
@@ -0,0 +1,227 @@
+
+#include <algorithm>
+#include <cmath>
+
+#include "glm/glm.hpp"
+
+#include "global.hpp"
+#include "lights.hpp"
+#include "ray.hpp"
+
+// Rectangles smaller than this solid angle are sampled by area, as for triangles
+const flt kMinRectSolidAngle = 3e-4;
+
+// Fill light_rec for a point at distance dist along wi, false if it is occluded
+static bool unoccluded(const Emissive* light, const HitRecord& rec, const Hittable* world, const vec3& wi, flt dist, HitRecord& light_rec)
+{
+    HitRecord occluder;
+    if (world->hit(Ray(rec.p, wi), vec2(kHitEps, dist - kHitEps), occluder))
+        return false;
+
+    light_rec.t = dist;
+    light_rec.p = rec.p + dist * wi;
+    light_rec.normal = -wi;
+    light_rec.mat = NULL;
+    light_rec.obj = NULL;
+    light_rec.light = light;
+    return true;
+}
+
+PointLight::PointLight(const vec3& position, const vec3& intensity)
+    : position(position)
+    , intensity(intensity)
+{
+}
+
+flt PointLight::get_area() const
+{
+    return 0.0f;
+}
+
+// The pdf of a delta light is 1, emitted includes the inverse square falloff
+flt PointLight::sample_ray(const HitRecord& rec, const Hittable* world, HitRecord& light_rec, vec3& wi) const
+{
+    vec3 d = position - rec.p;
+    flt dist = glm::length(d);
+    wi = d / dist;
+    if (!(dist > kHitEps) || glm::dot(rec.normal, wi) <= 0 || !(glm::compMax(emitted_towards(wi, dist)) > 0))
+        return 0.0f;
+    return unoccluded(this, rec, world, wi, dist, light_rec) ? 1.0f : 0.0f;
+}
+
+flt PointLight::pdf(const Ray& ray, const Hittable* world, HitRecord& light_rec) const
+{
+    return 0.0f;
+}
+
+vec3 PointLight::emitted(const HitRecord& light_rec, const vec3& wi) const
+{
+    return emitted_towards(wi, light_rec.t);
+}
+
+bool PointLight::is_delta() const
+{
+    return true;
+}
+
+vec3 PointLight::emitted_towards(const vec3& wi, flt dist) const
+{
+    return intensity / (dist * dist);
+}
+
+SpotLight::SpotLight(const vec3& position, const vec3& direction, const vec3& intensity, flt outer_angle, flt inner_angle)
+    : PointLight(position, intensity)
+    , direction(glm::normalize(direction))
+    , cos_outer(cosf(outer_angle))
+    , cos_inner(cosf(std::min(inner_angle, outer_angle)))
+{
+}
+
+vec3 SpotLight::emitted_towards(const vec3& wi, flt dist) const
+{
+    flt cos_theta = glm::dot(-wi, direction);
+    if (cos_theta <= cos_outer)
+        return vec3(0.0f);
+    flt falloff = 1.0f;
+    if (cos_theta < cos_inner) {
+        flt t = (cos_theta - cos_outer) / (cos_inner - cos_outer);
+        falloff = t * t * (3.0f - 2.0f * t);
+    }
+    return falloff * intensity / (dist * dist);
+}
+
+QuadLight::QuadLight(const vec3& corner, const vec3& u, const vec3& v, const vec3& radiance)
+    : corner(corner)
+    , u(u)
+    , v(v)
+    , normal(glm::normalize(glm::cross(u, v)))
+    , radiance(radiance)
+    , area(glm::length(glm::cross(u, v)))
+{
+}
+
+flt QuadLight::get_area() const
+{
+    return area;
+}
+
+// Spherical rectangle of the quad seen from origin, in the local frame of the quad
+void QuadLight::spherical_rect(const vec3& origin, SphericalRect& rect) const
+{
+    flt u_len = glm::length(u), v_len = glm::length(v);
+    rect.x = u / u_len;
+    rect.y = v / v_len;
+    rect.z = glm::cross(rect.x, rect.y);
+    vec3 d = corner - origin;
+    rect.z0 = glm::dot(d, rect.z);
+    if (rect.z0 > 0) {
+        rect.z = -rect.z;
+        rect.z0 = -rect.z0;
+    }
+    rect.x0 = glm::dot(d, rect.x);
+    rect.y0 = glm::dot(d, rect.y);
+    rect.x1 = rect.x0 + u_len;
+    rect.y1 = rect.y0 + v_len;
+
+    vec3 v00(rect.x0, rect.y0, rect.z0), v01(rect.x0, rect.y1, rect.z0);
+    vec3 v10(rect.x1, rect.y0, rect.z0), v11(rect.x1, rect.y1, rect.z0);
+    vec3 n0 = glm::normalize(glm::cross(v00, v10));
+    vec3 n1 = glm::normalize(glm::cross(v10, v11));
+    vec3 n2 = glm::normalize(glm::cross(v11, v01));
+    vec3 n3 = glm::normalize(glm::cross(v01, v00));
+    flt g0 = acosf(clamp(-glm::dot(n0, n1), -1.0f, 1.0f));
+    flt g1 = acosf(clamp(-glm::dot(n1, n2), -1.0f, 1.0f));
+    flt g2 = acosf(clamp(-glm::dot(n2, n3), -1.0f, 1.0f));
+    flt g3 = acosf(clamp(-glm::dot(n3, n0), -1.0f, 1.0f));
+    rect.b0 = n0[2];
+    rect.b1 = n2[2];
+    rect.k = 2 * PI - g2 - g3;
+    rect.solid_angle = g0 + g1 - rect.k;
+}
+
+flt QuadLight::sample_ray(const HitRecord& rec, const Hittable* world, HitRecord& light_rec, vec3& wi) const
+{
+    // Only the front face emits
+    if (glm::dot(normal, rec.p - corner) <= 0)
+        return 0.0f;
+
+    SphericalRect rect;
+    spherical_rect(rec.p, rect);
+    vec3 p;
+    if (rect.solid_angle > kMinRectSolidAngle) {
+        flt au = uniform() * rect.solid_angle + rect.k;
+        flt fu = (cosf(au) * rect.b0 - rect.b1) / sinf(au);
+        flt cu = clamp((fu > 0 ? 1.0f : -1.0f) / sqrtf(fu * fu + rect.b0 * rect.b0), -1.0f, 1.0f);
+        flt xu = clamp(-(cu * rect.z0) / sqrtf(std::max(kEps, 1.0f - cu * cu)), rect.x0, rect.x1);
+        flt d = sqrtf(xu * xu + rect.z0 * rect.z0);
+        flt h0 = rect.y0 / sqrtf(d * d + rect.y0 * rect.y0);
+        flt h1 = rect.y1 / sqrtf(d * d + rect.y1 * rect.y1);
+        flt hv = h0 + uniform() * (h1 - h0);
+        flt yv = hv * hv < 1.0f - kEps ? hv * d / sqrtf(1.0f - hv * hv) : rect.y1;
+        p = rec.p + xu * rect.x + yv * rect.y + rect.z0 * rect.z;
+    } else {
+        p = corner + uniform() * u + uniform() * v;
+    }
+
+    vec3 d = p - rec.p;
+    flt dist = glm::length(d);
+    wi = d / dist;
+    if (!(dist > kHitEps) || glm::dot(rec.normal, wi) <= 0 || !unoccluded(this, rec, world, wi, dist, light_rec))
+        return 0.0f;
+    light_rec.normal = normal;
+    return pdf_direction(rec.p, light_rec);
+}
+
+flt QuadLight::pdf_direction(const vec3& origin, const HitRecord& light_rec) const
+{
+    if (glm::dot(normal, origin - corner) <= 0)
+        return 0.0f;
+
+    SphericalRect rect;
+    spherical_rect(origin, rect);
+    if (rect.solid_angle > kMinRectSolidAngle)
+        return 1.0f / rect.solid_angle;
+
+    vec3 d = light_rec.p - origin;
+    flt dist2 = glm::dot(d, d);
+    return dist2 * sqrtf(dist2) / (area * glm::dot(origin - light_rec.p, normal));
+}
+
+// Only used on rays that already missed all the geometry in front of the quad
+flt QuadLight::pdf(const Ray& ray, const Hittable* world, HitRecord& light_rec) const
+{
+    HitRecord rec;
+    bool hit = world->hit(ray, vec2(kHitEps, INFINITY), rec);
+    if (!intersect(ray, hit ? rec.t : INFINITY, light_rec))
+        return 0.0f;
+    return pdf_direction(ray.origin, light_rec);
+}
+
+vec3 QuadLight::emitted(const HitRecord& light_rec, const vec3& wi) const
+{
+    return glm::dot(wi, normal) < 0 ? radiance : vec3(0.0f);
+}
+
+bool QuadLight::intersect(const Ray& ray, flt t_max, HitRecord& light_rec) const
+{
+    flt denom = glm::dot(ray.direction, normal);
+    if (denom >= 0)
+        return false;
+    flt t = glm::dot(corner - ray.origin, normal) / denom;
+    if (!(t > kHitEps && t < t_max))
+        return false;
+
+    vec3 p = ray.origin + t * ray.direction;
+    flt a = glm::dot(p - corner, u) / glm::dot(u, u);
+    flt b = glm::dot(p - corner, v) / glm::dot(v, v);
+    if (a < 0 || a > 1 || b < 0 || b > 1)
+        return false;
+
+    light_rec.t = t;
+    light_rec.p = p;
+    light_rec.normal = normal;
+    light_rec.mat = NULL;
+    light_rec.obj = NULL;
+    light_rec.light = this;
+    return true;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "global.hpp"
+#include "object.hpp"
+#include "ray.hpp"
+
+// Lights declared in the scene xml instead of on mesh triangles. They are not
+// in the BVH, so light samples only trace a shadow ray up to the sampled point.
+
+// Isotropic point light, intensity in W/sr
+class PointLight : public Emissive {
+public:
+    PointLight(const vec3& position, const vec3& intensity);
+
+    virtual flt get_area() const override;
+    virtual flt sample_ray(const HitRecord& rec, const Hittable* world, HitRecord& light_rec, vec3& wi) const override;
+    virtual flt pdf(const Ray& ray, const Hittable* world, HitRecord& light_rec) const override;
+    virtual vec3 emitted(const HitRecord& light_rec, const vec3& wi) const override;
+    virtual bool is_delta() const override;
+    // Irradiance factor towards a point at distance dist along wi
+    virtual vec3 emitted_towards(const vec3& wi, flt dist) const;
+
+public:
+    vec3 position;
+    vec3 intensity;
+};
+
+// Point light restricted to a cone around direction, fading out between the inner and outer half angles
+class SpotLight : public PointLight {
+public:
+    SpotLight(const vec3& position, const vec3& direction, const vec3& intensity, flt outer_angle, flt inner_angle);
+
+    virtual vec3 emitted_towards(const vec3& wi, flt dist) const override;
+
+public:
+    vec3 direction;
+    flt cos_outer, cos_inner;
+};
+
+// One-sided rectangle emitting towards cross(u, v), sampled by solid angle
+// Urena et al., "An Area-Preserving Parametrization for Spherical Rectangles", 2013
+class QuadLight : public Emissive {
+public:
+    QuadLight(const vec3& corner, const vec3& u, const vec3& v, const vec3& radiance);
+
+    virtual flt get_area() const override;
+    virtual flt sample_ray(const HitRecord& rec, const Hittable* world, HitRecord& light_rec, vec3& wi) const override;
+    virtual flt pdf(const Ray& ray, const Hittable* world, HitRecord& light_rec) const override;
+    virtual vec3 emitted(const HitRecord& light_rec, const vec3& wi) const override;
+
+    // Closest intersection with the front face before t_max
+    bool intersect(const Ray& ray, flt t_max, HitRecord& light_rec) const;
+    // Solid angle pdf of sample_ray from origin towards the point light_rec
+    flt pdf_direction(const vec3& origin, const HitRecord& light_rec) const;
+
+public:
+    vec3 corner, u, v;
+    vec3 normal;
+    vec3 radiance;
+    flt area;
+
+private:
+    struct SphericalRect {
+        vec3 x, y, z;
+        flt x0, y0, z0, x1, y1;
+        flt b0, b1, k;
+        flt solid_angle;
+    };
+    void spherical_rect(const vec3& origin, SphericalRect& rect) const;
+};
@@ -4,8 +4,10 @@
 
 #define TINYOBJLOADER_IMPLEMENTATION
 
+#include "distributed.hpp"
 #include "global.hpp"
 #include "misc.hpp"
+#include "options.hpp"
 #include "scene.hpp"
 
 // FOR SEGMENTATION FAULT DEBUG
@@ -33,24 +35,26 @@ void handler(int sig)
 int main(int argc, char** argv)
 {
     signal(SIGSEGV, handler);
-    std::string inputdir = "./";
-    std::string inputname = "input";
-    int sample_num = 30;
-    if (argc > 1) {
-        inputdir = std::string(argv[1]);
-    }
-    if (argc > 2) {
-        inputname = std::string(argv[2]);
-    }
-    if (argc > 3) {
-        sample_num = std::stoi(argv[3]);
-    }
+    RenderOptions options;
+    options.parse(argc, argv);
 
-    Scene scene(inputdir, inputname);
+    Scene scene(options.inputdir, options.inputname);
+    scene.options = options;
     Timer timer;
 
     timer.start();
-    scene.render(inputname + ".jpg", sample_num);
+    std::string outfile = options.inputname + ".jpg";
+    if (options.connect.empty()) {
+        scene.render(outfile, options.sample_num);
+    } else {
+        // Worker of a coordinator, renders parts until none is left
+        int connection;
+        while ((connection = request_part(options.connect, scene.options.part, scene.options.parts)) >= 0) {
+            scene.render(outfile, options.sample_num);
+            if (!send_partial(connection, partial_file(outfile, scene.options.part)))
+                INFO("Cannot send part %d to the coordinator\n", scene.options.part);
+        }
+    }
     timer.end();
 
     timer.end_and_output("Render elasped time:");
@@ -1,4 +1,4 @@
-
+#include <algorithm>
 #include <cmath>
 
 #include "glm/glm.hpp"
@@ -23,28 +23,26 @@ PhongMaterial::PhongMaterial()
 
 vec3 to_world(const vec3& p_local, const vec3& axisz)
 {
-    // Tranform the local coordinate to the world
-    // following tranformation may be biased
-    vec3 axisy;
-    do {
-        axisy = vec3(uniform(-1, 1), uniform(-1, 1), uniform(-1, 1));
-    } while (glm::cross(axisy, axisz).length() < kEps);
-    axisy = glm::normalize(glm::cross(axisy, axisz));
-    vec3 axisx = glm::normalize(glm::cross(axisy, axisz));
+    // Tranform the local coordinate to the world, orthonormal basis of
+    // Duff et al. 2017 "Building an Orthonormal Basis, Revisited"
+    flt sign = axisz[2] >= 0.0f ? 1.0f : -1.0f;
+    flt a = -1.0f / (sign + axisz[2]);
+    flt b = axisz[0] * axisz[1] * a;
+    vec3 axisx = vec3(1.0f + sign * axisz[0] * axisz[0] * a, sign * b, -sign * axisz[0]);
+    vec3 axisy = vec3(b, sign + axisz[1] * axisz[1] * a, -axisz[1]);
 
     mat3 trans_mat = mat3(axisx, axisy, axisz);
     vec3 p_world = trans_mat * p_local;
     return p_world;
 }
 
-vec3 angle_to_cartesian(flt cos_theta, flt cos_phi)
+vec3 angle_to_cartesian(flt cos_theta, flt phi)
 {
 
-    flt sin_theta = sqrtf(1.0f - cos_theta * cos_theta);
-    flt sin_phi = sqrtf(1.0f - cos_phi * cos_phi);
+    flt sin_theta = sqrtf(std::max(0.0f, 1.0f - cos_theta * cos_theta));
 
-    flt p_x = sin_theta * cos_phi;
-    flt p_y = sin_theta * sin_phi;
+    flt p_x = sin_theta * cosf(phi);
+    flt p_y = sin_theta * sinf(phi);
     flt p_z = cos_theta;
 
     vec3 p_local = vec3(p_x, p_y, p_z);
@@ -55,8 +53,7 @@ flt PhongMaterial::sample_lambertian(const vec3& wo, const HitRecord& rec, vec3&
 {
     flt phi = uniform(0, 2 * PI);
     flt cos_theta = sqrtf(1.0f - uniform());
-    flt cos_phi = cosf(phi);
-    vec3 p_local = angle_to_cartesian(cos_theta, cos_phi);
+    vec3 p_local = angle_to_cartesian(cos_theta, phi);
     wi = to_world(p_local, rec.normal);
     flt pdf = cos_theta / PI;
     if (glm::dot(wi, rec.normal) <= 0)
@@ -71,8 +68,7 @@ flt PhongMaterial::sample_specular(const vec3& wo, const HitRecord& rec, vec3& w
     flt pdf;
     flt phi = uniform(0, 2 * PI);
     flt cos_theta = powf(uniform(), 1.0f / (Ns + 1));
-    flt cos_phi = cosf(phi);
-    vec3 p_local = angle_to_cartesian(cos_theta, cos_phi);
+    vec3 p_local = angle_to_cartesian(cos_theta, phi);
 
     if (is_bling_phong) {
         vec3 half = to_world(p_local, rec.normal);
@@ -149,6 +145,11 @@ vec3 PhongMaterial::bsdf(const vec3& wo, const vec3& wi, const HitRecord& rec) c
     return fr;
 }
 
+vec3 PhongMaterial::albedo(const HitRecord& rec) const
+{
+    return has_texture ? texture.at(rec.uv) : Kd;
+}
+
 flt PhongMaterial::pdf_lambertian(const vec3& wo, const vec3& normal, const vec3& wi) const
 {
     flt pdf = std::max(0.0f, glm::dot(wi, normal) / PI);
@@ -245,6 +246,11 @@ flt GlassMaterial::pdf(const vec3& wo, const HitRecord& rec, const vec3& wi) con
     return 1.0f;
 }
 
+vec3 GlassMaterial::albedo(const HitRecord& rec) const
+{
+    return vec3(1.0f);
+}
+
 Material::material_type GlassMaterial::type(vec3& vec) const
 {
     vec[0] = Ni;
@@ -18,8 +18,14 @@ public:
     virtual flt pdf(const vec3& wo, const HitRecord& rec, const vec3& wi) const = 0;
     virtual vec3 bsdf(const vec3& wo, const vec3& wi, const HitRecord& rec) const = 0;
     virtual material_type type(vec3& vec) const = 0;
+    // Diffuse reflectance at the hit point
+    virtual vec3 albedo(const HitRecord& rec) const = 0;
 };
 
+// Local shading frame helpers, z is the given axis
+vec3 to_world(const vec3& p_local, const vec3& axisz);
+vec3 angle_to_cartesian(flt cos_theta, flt phi);
+
 class Texture {
 public:
     Texture();
@@ -52,6 +58,7 @@ public:
     virtual vec3 bsdf(const vec3& wo, const vec3& wi, const HitRecord& rec) const override;
     virtual material_type type(vec3& vec) const override;
     virtual flt pdf(const vec3& wo, const HitRecord& rec, const vec3& wi) const override;
+    virtual vec3 albedo(const HitRecord& rec) const override;
 
     flt sample_lambertian(const vec3& wo, const HitRecord& rec, vec3& wi) const;
     flt sample_specular(const vec3& wo, const HitRecord& rec, vec3& wi) const;
@@ -77,6 +84,7 @@ public:
     virtual vec3 bsdf(const vec3& wo, const vec3& wi, const HitRecord& rec) const override;
     virtual material_type type(vec3& vec) const override;
     virtual flt pdf(const vec3& wo, const HitRecord& rec, const vec3& wi) const override;
+    virtual vec3 albedo(const HitRecord& rec) const override;
 
 public:
     flt Ni;
@@ -0,0 +1,72 @@
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "buffer.hpp"
+#include "checkpoint.hpp"
+#include "distributed.hpp"
+#include "global.hpp"
+#include "image_formats.hpp"
+
+// mcpt-merge {output.jpg|pfm|exr} {partial.ckpt ...} [--paste {crop.ckpt ...}]
+// mcpt-merge {output.jpg} --serve {socket} {parts}
+//
+// Adds up the partial buffers of a distributed render into output.jpg and its
+// checkpoint output.ckpt, which --resume can continue when the parts cover the
+// samples from 1 on without a gap. With --serve the parts
+// are handed to `mcpt ... --connect {socket}` workers and received first.
+// The buffers of --crop renders after --paste replace the pixels they cover.
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+        ERRORM("Usage: %s {output.jpg} {partial.ckpt ...} [--paste {crop.ckpt ...}] | --serve {socket} {parts}\n", argv[0]);
+    std::string outfile(argv[1]);
+    std::vector<std::string> files, patches;
+    if (std::string(argv[2]) == "--serve") {
+        if (argc != 5)
+            ERRORM("--serve needs {socket} {parts}\n");
+        int parts = std::stoi(argv[4]);
+        if (parts <= 0)
+            ERRORM("{parts} must be positive\n");
+        coordinate(argv[3], parts, outfile);
+        for (int part = 0; part < parts; part++)
+            files.push_back(partial_file(outfile, part));
+    } else {
+        char** paste = std::find(argv + 2, argv + argc, std::string("--paste"));
+        files.assign(argv + 2, paste);
+        if (paste != argv + argc)
+            patches.assign(paste + 1, argv + argc);
+        if (files.empty())
+            ERRORM("--paste needs a buffer to paste into\n");
+    }
+
+    Buffer buffer;
+    CheckpointInfo info;
+    bool resumable;
+    int num_samples = merge_partials(files, buffer, info, resumable);
+    INFO("Merged %d parts, %d samples per pixel\n", static_cast<int>(files.size()), num_samples);
+    for (auto& file : patches) {
+        Buffer patch;
+        CheckpointInfo patch_info;
+        if (!load_checkpoint(file, patch, patch_info, true))
+            ERRORM("Cannot read %s\n", file.c_str());
+        if (patch_info.integrator != info.integrator || patch.tracks_samples() != buffer.tracks_samples())
+            ERRORM("%s was rendered by the %s integrator, not %s\n", file.c_str(), patch_info.integrator.c_str(), info.integrator.c_str());
+        // Without sample counts every pixel is normalized by the same number
+        if (!buffer.tracks_samples() && patch_info.num_samples() != num_samples)
+            ERRORM("%s has %d samples, not %d\n", file.c_str(), patch_info.num_samples(), num_samples);
+        buffer.paste(patch);
+        INFO("Pasted %s at %d, %d\n", file.c_str(), patch.x0, patch.y0);
+    }
+    if (!patches.empty() && buffer.tracks_samples())
+        info.rendered = num_samples = buffer.min_samples();
+    if (!write_image(outfile, buffer, num_samples))
+        ERRORM("Cannot write %s\n", outfile.c_str());
+    // Resuming after a gap would render the samples after it a second time
+    std::string ckpt = outfile.substr(0, outfile.find_last_of('.')) + ".ckpt";
+    if (!resumable)
+        INFO("The parts leave a gap in the sample numbers, %s is not written\n", ckpt.c_str());
+    else if (!save_checkpoint(ckpt, buffer, info))
+        ERRORM("Cannot write %s\n", ckpt.c_str());
+    return 0;
+}
@@ -0,0 +1,205 @@
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include <omp.h>
+
+#include "buffer.hpp"
+#include "global.hpp"
+#include "mlt.hpp"
+#include "scene.hpp"
+
+const flt kMutationSigma = 0.01;
+const flt kLargeStepProb = 0.3;
+
+PrimarySample::PrimarySample(unsigned int seed, flt sigma, flt large_step_prob)
+    : rng(seed)
+    , uni(0.0f, 1.0f)
+    , normal(0.0f, 1.0f)
+    , iteration(0)
+    , last_large_step(0)
+    , large_step(true)
+    , dim(0)
+    , sigma(sigma)
+    , large_step_prob(large_step_prob)
+{
+}
+
+void PrimarySample::start_iteration()
+{
+    iteration++;
+    large_step = uni(rng) < large_step_prob;
+    dim = 0;
+}
+
+void PrimarySample::accept()
+{
+    if (large_step)
+        last_large_step = iteration;
+    dim = 0;
+}
+
+void PrimarySample::reject()
+{
+    for (auto& Xi : X) {
+        if (Xi.modify == iteration) {
+            Xi.value = Xi.backup;
+            Xi.modify = Xi.modify_backup;
+        }
+    }
+    iteration--;
+    dim = 0;
+}
+
+// Bring X[index] up to the current iteration, replaying the small steps it missed at once
+void PrimarySample::ensure(int index)
+{
+    if (index >= static_cast<int>(X.size())) {
+        Sample fresh = { 0.0f, 0.0f, 0, 0 };
+        X.resize(index + 1, fresh);
+    }
+    Sample& Xi = X[index];
+
+    if (Xi.modify < last_large_step) {
+        Xi.value = uni(rng);
+        Xi.modify = last_large_step;
+    }
+
+    Xi.backup = Xi.value;
+    Xi.modify_backup = Xi.modify;
+    if (large_step) {
+        Xi.value = uni(rng);
+    } else {
+        long long num_small = iteration - Xi.modify;
+        Xi.value += normal(rng) * sigma * sqrtf(static_cast<flt>(num_small));
+        Xi.value -= floorf(Xi.value);
+    }
+    Xi.value = std::min(Xi.value, 1.0f - kEps);
+    Xi.modify = iteration;
+}
+
+flt PrimarySample::next()
+{
+    ensure(dim);
+    return X[dim++].value;
+}
+
+MarkovChain::MarkovChain(unsigned int sample_seed, unsigned int chain_seed)
+    : sampler(sample_seed, kMutationSigma, kLargeStepProb)
+    , rng(chain_seed)
+    , L(0.0f)
+    , pixel(0, 0)
+{
+}
+
+MLT::MLT(int num_bootstrap, int num_chain)
+    : num_bootstrap(num_bootstrap)
+    , num_chain(num_chain)
+    , b(0)
+    , next_sample(0)
+{
+}
+
+// All the random numbers of one path come from sampler, the first two pick the pixel
+vec3 MLT::evaluate(Scene& scene, PrimarySample& sampler, ivec2& pixel)
+{
+    random_source() = &sampler;
+    int x = std::min(static_cast<int>(uniform() * scene.buffer.width), scene.buffer.width - 1);
+    int y = std::min(static_cast<int>(uniform() * scene.buffer.height), scene.buffer.height - 1);
+    vec3 L = scene.Li(scene.camera.cast_ray(x, y), scene.bvh_root);
+    random_source() = NULL;
+
+    pixel = ivec2(x, y);
+    if (!(std::isfinite(L[0]) && std::isfinite(L[1]) && std::isfinite(L[2])))
+        return vec3(0.0f);
+    return L;
+}
+
+void MLT::init(Scene& scene)
+{
+    next_sample = 0;
+    splats.assign(omp_get_max_threads(), Buffer(scene.buffer.width, scene.buffer.height));
+    for (auto& splat : splats)
+        splat.clear();
+}
+
+// The chains of a part or a resumed render start where its samples start, every
+// seed depends on the first sample number so no two of them replay the same paths
+void MLT::start(Scene& scene, int first_sample)
+{
+    unsigned int seed = static_cast<unsigned int>(first_sample - 1) * (num_bootstrap + 2 * num_chain);
+
+    // Bootstrap, estimate b and keep the weights to seed the chains
+    std::vector<flt> weight_sum(num_bootstrap);
+#pragma omp parallel for schedule(dynamic, 64)
+    for (int i = 0; i < num_bootstrap; i++) {
+        PrimarySample sampler(seed + i, kMutationSigma, kLargeStepProb);
+        ivec2 pixel;
+        weight_sum[i] = luminance(evaluate(scene, sampler, pixel));
+    }
+    for (int i = 1; i < num_bootstrap; i++)
+        weight_sum[i] += weight_sum[i - 1];
+    b = weight_sum.back() / num_bootstrap;
+    INFO("MLT bootstrap: %d paths, b = %f\n", num_bootstrap, b);
+    if (!(b > 0))
+        ERRORM("MLT bootstrap found no light\n");
+
+    // Start every chain from a bootstrap path chosen by its weight, replayed from its seed
+    chains.clear();
+    chains.reserve(num_chain);
+    for (int i = 0; i < num_chain; i++) {
+        std::mt19937 rng(seed + num_bootstrap + i);
+        flt a = std::uniform_real_distribution<flt>(0.0f, weight_sum.back())(rng);
+        int id = std::lower_bound(weight_sum.begin(), weight_sum.end(), a) - weight_sum.begin();
+        chains.push_back(MarkovChain(seed + std::min(id, num_bootstrap - 1), seed + num_bootstrap + num_chain + i));
+    }
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < num_chain; i++) {
+        chains[i].L = evaluate(scene, chains[i].sampler, chains[i].pixel);
+    }
+}
+
+void MLT::render_sample(Scene& scene, int now_sample)
+{
+    if (now_sample != next_sample)
+        start(scene, now_sample);
+    next_sample = now_sample + 1;
+    Buffer& buffer = scene.buffer;
+    long long num_mutation = static_cast<long long>(buffer.width) * buffer.height;
+
+#pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < num_chain; c++) {
+        MarkovChain& chain = chains[c];
+        Buffer& splat = splats[omp_get_thread_num()];
+        std::uniform_real_distribution<flt> uni(0.0f, 1.0f);
+        long long chain_mutation = num_mutation / num_chain + (c < num_mutation % num_chain ? 1 : 0);
+
+        for (long long m = 0; m < chain_mutation; m++) {
+            chain.sampler.start_iteration();
+            ivec2 pixel;
+            vec3 L = evaluate(scene, chain.sampler, pixel);
+
+            // Expected value splatting of both the current and the proposed state
+            flt I_cur = luminance(chain.L);
+            flt I_new = luminance(L);
+            flt accept = I_cur > 0 ? std::min(1.0f, I_new / I_cur) : 1.0f;
+            if (I_new > 0)
+                splat.add(pixel[0], pixel[1], L * (b * accept / I_new));
+            if (I_cur > 0)
+                splat.add(chain.pixel[0], chain.pixel[1], chain.L * (b * (1.0f - accept) / I_cur));
+
+            if (uni(chain.rng) < accept) {
+                chain.sampler.accept();
+                chain.L = L;
+                chain.pixel = pixel;
+            } else {
+                chain.sampler.reject();
+            }
+        }
+    }
+
+    for (auto& splat : splats)
+        buffer.merge(splat);
+}
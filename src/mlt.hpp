@@ -0,0 +1,74 @@
+#pragma once
+
+#include <random>
+#include <vector>
+
+#include "buffer.hpp"
+#include "global.hpp"
+#include "integrator.hpp"
+
+class Scene;
+
+// Primary sample space vector with lazily evaluated Kelemen mutations
+// Kelemen et al., "A Simple and Robust Mutation Strategy for the Metropolis Light Transport Algorithm", 2002
+class PrimarySample : public RandomSource {
+public:
+    PrimarySample(unsigned int seed, flt sigma, flt large_step_prob);
+    void start_iteration();
+    void accept();
+    void reject();
+    virtual flt next() override;
+
+private:
+    struct Sample {
+        flt value, backup;
+        long long modify, modify_backup;
+    };
+    void ensure(int index);
+
+    std::mt19937 rng;
+    std::uniform_real_distribution<flt> uni;
+    std::normal_distribution<flt> normal;
+
+    std::vector<Sample> X;
+    long long iteration;
+    long long last_large_step;
+    bool large_step;
+    int dim;
+    flt sigma;
+    flt large_step_prob;
+};
+
+struct MarkovChain {
+    MarkovChain(unsigned int sample_seed, unsigned int chain_seed);
+
+    PrimarySample sampler;
+    std::mt19937 rng;
+    vec3 L;
+    ivec2 pixel;
+};
+
+// Primary sample space Metropolis light transport on top of Scene::Li,
+// normalized by a bootstrap pass. One sample pass runs as many mutations
+// as there are pixels, spread over the independent chains.
+class MLT : public Integrator {
+public:
+    MLT(int num_bootstrap, int num_chain);
+    virtual void init(Scene& scene) override;
+    virtual void render_sample(Scene& scene, int now_sample) override;
+
+public:
+    int num_bootstrap;
+    int num_chain;
+    // Average luminance of the image, estimated by the bootstrap pass
+    flt b;
+    std::vector<MarkovChain> chains;
+    // Splatted contributions of each thread
+    std::vector<Buffer> splats;
+    // Sample number the chains continue with, another one starts them anew
+    int next_sample;
+
+private:
+    void start(Scene& scene, int first_sample);
+    vec3 evaluate(Scene& scene, PrimarySample& sampler, ivec2& pixel);
+};
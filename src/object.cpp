@@ -5,7 +5,10 @@
 
 #include "glm/glm.hpp"
 
+#include "envmap.hpp"
 #include "global.hpp"
+#include "light_cache.hpp"
+#include "lights.hpp"
 #include "material.hpp"
 #include "object.hpp"
 #include "ray.hpp"
@@ -93,53 +96,153 @@ flt Triangle::get_area() const
     return area;
 }
 
+// Spherical triangles smaller or larger than this are sampled by area,
+// where Arvo's method loses too much precision in float
+const flt kMinSphericalSampleArea = 3e-4;
+const flt kMaxSphericalSampleArea = 6.22;
 
+// Angle between two normalized vectors, robust for nearly parallel ones
+inline flt angle_between(const vec3& v1, const vec3& v2)
+{
+    if (glm::dot(v1, v2) < 0)
+        return PI - 2 * asinf(std::min(1.0f, glm::length(v1 + v2) / 2));
+    return 2 * asinf(std::min(1.0f, glm::length(v2 - v1) / 2));
+}
+
+// Component of v orthogonal to the normalized vector w, normalized
+inline vec3 gram_schmidt(const vec3& v, const vec3& w)
+{
+    return glm::normalize(v - glm::dot(v, w) * w);
+}
+
+// Solid angle of the triangle seen from origin, 0 if it is degenerate
+flt Triangle::solid_angle(const vec3& origin) const
+{
+    vec3 a = glm::normalize(p[0] - origin);
+    vec3 b = glm::normalize(p[1] - origin);
+    vec3 c = glm::normalize(p[2] - origin);
+
+    vec3 n_ab = glm::cross(a, b);
+    vec3 n_bc = glm::cross(b, c);
+    vec3 n_ca = glm::cross(c, a);
+    if (glm::dot(n_ab, n_ab) < kEps || glm::dot(n_bc, n_bc) < kEps || glm::dot(n_ca, n_ca) < kEps)
+        return 0.0f;
+    n_ab = glm::normalize(n_ab);
+    n_bc = glm::normalize(n_bc);
+    n_ca = glm::normalize(n_ca);
+
+    flt alpha = angle_between(n_ab, -n_ca);
+    flt beta = angle_between(n_bc, -n_ab);
+    flt gamma = angle_between(n_ca, -n_bc);
+    return std::max(0.0f, alpha + beta + gamma - PI);
+}
+
+// Arvo, "Stratified Sampling of Spherical Triangles", SIGGRAPH 1995
+// Returns a direction uniformly distributed in the solid angle of the triangle
+vec3 Triangle::sample_direction(const vec3& origin, flt solid_angle) const
+{
+    vec3 a = glm::normalize(p[0] - origin);
+    vec3 b = glm::normalize(p[1] - origin);
+    vec3 c = glm::normalize(p[2] - origin);
+
+    vec3 n_ab = glm::normalize(glm::cross(a, b));
+    vec3 n_ca = glm::normalize(glm::cross(c, a));
+    flt alpha = angle_between(n_ab, -n_ca);
+
+    // Pick the sub-triangle area, then the vertex c' that produces it
+    flt area_p = uniform() * solid_angle + PI;
+    flt cos_alpha = cosf(alpha), sin_alpha = sinf(alpha);
+    flt sin_phi = sinf(area_p) * cos_alpha - cosf(area_p) * sin_alpha;
+    flt cos_phi = cosf(area_p) * cos_alpha + sinf(area_p) * sin_alpha;
+
+    flt k1 = cos_phi + cos_alpha;
+    flt k2 = sin_phi - sin_alpha * glm::dot(a, b);
+    flt cos_bp = (k2 + (k2 * cos_phi - k1 * sin_phi) * cos_alpha) / ((k2 * sin_phi + k1 * cos_phi) * sin_alpha);
+    cos_bp = clamp(cos_bp, -1.0f, 1.0f);
+    flt sin_bp = sqrtf(std::max(0.0f, 1.0f - cos_bp * cos_bp));
+    vec3 cp = cos_bp * a + sin_bp * gram_schmidt(c, a);
+
+    // Uniform point on the arc between b and c'
+    flt cos_theta = 1.0f - uniform() * (1.0f - glm::dot(cp, b));
+    flt sin_theta = sqrtf(std::max(0.0f, 1.0f - cos_theta * cos_theta));
+    return cos_theta * b + sin_theta * gram_schmidt(cp, b);
+}
+
+// Sample the triangle by solid angle when it is well conditioned, otherwise by area.
+// pdf_direction makes the same choice so that MIS weights stay consistent.
 flt Triangle::sample_ray(const HitRecord& rec, const Hittable* world, HitRecord& light_rec, vec3& wi) const
 {
-    vec3 sample_p = this->sample_point();
-    Ray light_ray(rec.p, sample_p - rec.p);
-    flt pdf = 0.0f;
+    // Only the front face emits
+    if (glm::dot(normal, rec.p - p[0]) <= 0)
+        return 0.0f;
 
-    wi = light_ray.direction;
+    flt sa = this->solid_angle(rec.p);
+    bool by_solid_angle = inside(sa, kMinSphericalSampleArea, kMaxSphericalSampleArea);
+    if (by_solid_angle)
+        wi = this->sample_direction(rec.p, sa);
+    else
+        wi = glm::normalize(this->sample_point() - rec.p);
 
-    if (world->hit(light_ray, vec2(kHitEps, INFINITY), light_rec)
-        && glm::dot(light_rec.p - sample_p, light_rec.p - sample_p) < kEps
-        && glm::dot(rec.normal, wi) > 0
-        && glm::dot(light_rec.normal, wi) < 0) {
+    Ray light_ray(rec.p, wi);
+    flt pdf = 0.0f;
 
-        vec3 distance = rec.p - light_rec.p;
-        flt area = this->get_area();
-        pdf = glm::dot(distance, distance) / (area * glm::dot(-wi, light_rec.normal));
+    // Find the point on this triangle first, the shadow ray then stops before it
+    HitRecord occluder;
+    if (glm::dot(rec.normal, wi) > 0
+        && this->hit(light_ray, vec2(kHitEps, INFINITY), light_rec)
+        && glm::dot(light_rec.normal, wi) < 0
+        && !world->hit(light_ray, vec2(kHitEps, light_rec.t - kHitEps), occluder)) {
+
+        if (by_solid_angle) {
+            pdf = 1.0f / sa;
+        } else {
+            vec3 distance = rec.p - light_rec.p;
+            pdf = glm::dot(distance, distance) / (area * glm::dot(-wi, light_rec.normal));
+        }
     }
     return pdf;
 }
 
+// Solid angle pdf of sampling wi from origin, given that it hits this triangle at light_rec
+flt Triangle::pdf_direction(const vec3& origin, const vec3& wi, const HitRecord& light_rec) const
+{
+    if (glm::dot(light_rec.normal, wi) >= 0)
+        return 0.0f;
+
+    flt sa = this->solid_angle(origin);
+    if (inside(sa, kMinSphericalSampleArea, kMaxSphericalSampleArea))
+        return 1.0f / sa;
+
+    vec3 distance = origin - light_rec.p;
+    return glm::dot(distance, distance) / (area * glm::dot(-wi, light_rec.normal));
+}
+
 // Maybe useless
 flt Triangle::pdf(const Ray& ray, const Hittable* world, HitRecord& light_rec) const
 {
     flt pdf = 0.0f;
 
     if (world->hit(ray, vec2(kHitEps, INFINITY), light_rec)
-        && light_rec.obj == this
-        && glm::dot(light_rec.normal, ray.direction) < 0) {
-
-        vec3 distance = ray.origin - light_rec.p;
-        flt area = this->get_area();
-        pdf = glm::dot(distance, distance) / (area * glm::dot(-ray.direction, light_rec.normal));
+        && light_rec.obj == this) {
+        pdf = this->pdf_direction(ray.origin, ray.direction, light_rec);
     }
     return pdf;
 }
 
 EmissiveGroup::EmissiveGroup()
+    : envmap(NULL)
+    , light_cache(NULL)
 {
 }
 
 EmissiveGroup::EmissiveGroup(const std::vector<Emissive*>& emissive_objects)
+    : envmap(NULL)
+    , light_cache(NULL)
 {
     this->init(emissive_objects);
 }
 
-void EmissiveGroup::init(const std::vector<Emissive*>& emissive_objects)
+void EmissiveGroup::init(const std::vector<Emissive*>& emissive_objects, EnvironmentMap* environment)
 {
     emissive_list.assign(emissive_objects.begin(), emissive_objects.end());
     DEBUGM("emissive group size: %d\n", emissive_list.size());
@@ -149,6 +252,56 @@ void EmissiveGroup::init(const std::vector<Emissive*>& emissive_objects)
         sample_sum.push_back((1.0f * (i + 1)));
         emissive_set.insert(std::make_pair(emissive_list[i], i));
     }
+
+    quads.clear();
+    for (auto emi : emissive_list) {
+        QuadLight* quad = dynamic_cast<QuadLight*>(emi);
+        if (quad)
+            quads.push_back(quad);
+    }
+
+    // the environment gets as many samples as all the other emissives together
+    envmap = environment;
+    if (envmap) {
+        flt weight = std::max(1.0f, static_cast<flt>(emissive_list.size()));
+        sample_sum.push_back((sample_sum.empty() ? 0.0f : sample_sum.back()) + weight);
+        emissive_set.insert(std::make_pair(static_cast<Emissive*>(envmap), emissive_list.size()));
+        emissive_list.push_back(envmap);
+    }
+}
+
+bool EmissiveGroup::is_delta(const HitRecord& light_rec) const
+{
+    return !light_rec.mat && light_rec.light && light_rec.light->is_delta();
+}
+
+vec3 EmissiveGroup::emission(const Ray& ray, flt t_max) const
+{
+    vec3 color(0.0f);
+    HitRecord light_rec;
+    for (auto quad : quads) {
+        if (quad->intersect(ray, t_max, light_rec))
+            color += quad->radiance;
+    }
+    return color;
+}
+
+flt EmissiveGroup::select_pdf(int id, const vec3& p) const
+{
+    if (light_cache)
+        return light_cache->pdf(light_cache->cell(p), id);
+    return (id == 0 ? sample_sum[id] : sample_sum[id] - sample_sum[id - 1]) / sample_sum[sample_sum.size() - 1];
+}
+
+vec3 EmissiveGroup::radiance(const HitRecord& light_rec, const vec3& wi) const
+{
+    if (!light_rec.mat)
+        return light_rec.light ? light_rec.light->emitted(light_rec, wi) : vec3(0.0f);
+
+    vec3 Le;
+    if (light_rec.mat->type(Le) != Material::LIGHT)
+        ERRORM("Not an emissive!\n");
+    return Le;
 }
 
 flt EmissiveGroup::get_area() const
@@ -160,15 +313,28 @@ flt EmissiveGroup::get_area() const
     return area;
 }
 
-// sample ray in emissive list, each emissive has the same probability
+// sample ray in emissive list, proportionally to the weights in sample_sum
+// or to the contributions learned by the light cache
 flt EmissiveGroup::sample_ray(const HitRecord& rec, const Hittable* world, HitRecord& light_rec, vec3& wi) const
 {
+    if (light_cache) {
+        int cell = light_cache->cell(rec.p);
+        flt select;
+        int id = light_cache->sample(cell, select);
+        flt pdf = emissive_list[id]->sample_ray(rec, world, light_rec, wi);
+        flt value = 0.0f;
+        if (pdf > 0)
+            value = luminance(radiance(light_rec, wi)) * std::abs(glm::dot(rec.normal, wi)) / pdf;
+        light_cache->record(cell, id, value);
+        return pdf * select;
+    }
+
     flt a = uniform() * sample_sum[sample_sum.size() - 1];
     int id = std::lower_bound(sample_sum.begin(), sample_sum.end(), a) - sample_sum.begin();
     Emissive* sample_emissive = emissive_list[id];
 
     flt pdf = sample_emissive->sample_ray(rec, world, light_rec, wi);
-    pdf *= (id == 0 ? sample_sum[id] : sample_sum[id] - sample_sum[id - 1]) / sample_sum[sample_sum.size() - 1];
+    pdf *= select_pdf(id, rec.p);
     return pdf;
 }
 
@@ -177,18 +343,36 @@ flt EmissiveGroup::pdf(const Ray& ray, const Hittable* world, HitRecord& light_r
     flt pdf = 0.0f;
 
     // TODO: ugly code
-    if (world->hit(ray, vec2(kHitEps, INFINITY), light_rec)) {
+    bool hit = world->hit(ray, vec2(kHitEps, INFINITY), light_rec);
+
+    // The closest quad light in front of the geometry
+    QuadLight* hit_quad = NULL;
+    HitRecord quad_rec;
+    for (auto quad : quads) {
+        if (quad->intersect(ray, hit_quad ? quad_rec.t : (hit ? light_rec.t : INFINITY), quad_rec))
+            hit_quad = quad;
+    }
+
+    if (hit_quad) {
+        light_rec = quad_rec;
+        light_rec.light = hit_quad;
+        pdf = hit_quad->pdf_direction(ray.origin, light_rec) * select_pdf(emissive_set.find(hit_quad)->second, ray.origin);
+    } else if (hit) {
         auto hit_emi_obj = dynamic_cast<Triangle*>(light_rec.obj);
 
         if (emissive_set.count(hit_emi_obj)
             && glm::dot(light_rec.normal, ray.direction) < 0) {
 
-            vec3 distance = ray.origin - light_rec.p;
-            flt area = hit_emi_obj->get_area();
-            pdf = glm::dot(distance, distance) / (area * glm::dot(-ray.direction, light_rec.normal));
+            pdf = hit_emi_obj->pdf_direction(ray.origin, ray.direction, light_rec);
             int id = emissive_set.find(hit_emi_obj)->second;
-            pdf *= (id == 0 ? sample_sum[id] : sample_sum[id] - sample_sum[id - 1]) / sample_sum[sample_sum.size() - 1];
+            pdf *= select_pdf(id, ray.origin);
         }
+    } else if (envmap) {
+        light_rec.t = INFINITY;
+        light_rec.mat = NULL;
+        light_rec.obj = NULL;
+        light_rec.light = envmap;
+        pdf = envmap->pdf_direction(ray.direction) * select_pdf(emissive_set.find(envmap)->second, ray.origin);
     }
     return pdf;
 }
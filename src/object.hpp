@@ -7,6 +7,10 @@
 #include "global.hpp"
 #include "ray.hpp"
 
+class EnvironmentMap;
+class QuadLight;
+class LightCache;
+
 class Hittable {
 public:
     virtual bool hit(const Ray& ray, const vec2& t_range, HitRecord& rec) const = 0;
@@ -19,6 +23,10 @@ public:
 
     virtual flt sample_ray(const HitRecord& rec, const Hittable* world, HitRecord& light_rec, vec3& wi) const = 0;
     virtual flt pdf(const Ray& ray, const Hittable* world, HitRecord& light_rec) const = 0;
+    // Radiance along wi of a light record without a material
+    virtual vec3 emitted(const HitRecord& light_rec, const vec3& wi) const { return vec3(0.0f); }
+    // Point and spot lights can't be found by scattered rays
+    virtual bool is_delta() const { return false; }
 };
 
 class Triangle : public Hittable, public Emissive {
@@ -39,6 +47,9 @@ public:
     virtual flt pdf(const Ray& ray, const Hittable* world, HitRecord& light_rec) const override;
 
     vec3 sample_point() const;
+    vec3 sample_direction(const vec3& origin, flt solid_angle) const;
+    flt solid_angle(const vec3& origin) const;
+    flt pdf_direction(const vec3& origin, const vec3& wi, const HitRecord& light_rec) const;
 
 public:
     vec3 p[3];
@@ -55,7 +66,12 @@ public:
     EmissiveGroup();
     EmissiveGroup(const std::vector<Emissive*>& emissive_objects);
 
-    void init(const std::vector<Emissive*>& emissive_objects);
+    void init(const std::vector<Emissive*>& emissive_objects, EnvironmentMap* environment = NULL);
+    // Radiance arriving along wi from a light record of sample_ray or pdf
+    vec3 radiance(const HitRecord& light_rec, const vec3& wi) const;
+    bool is_delta(const HitRecord& light_rec) const;
+    // Emission of the quad lights crossed by ray before t_max, they are not in the BVH
+    vec3 emission(const Ray& ray, flt t_max) const;
 
     virtual flt get_area() const override;
 
@@ -66,4 +82,13 @@ public:
     std::vector<flt> sample_sum;
     std::vector<Emissive*> emissive_list;
     std::map<Emissive*, int> emissive_set;
+    // Also in emissive_list, NULL without an environment
+    EnvironmentMap* envmap;
+    std::vector<QuadLight*> quads;
+    // Learned light selection, NULL selects by sample_sum
+    LightCache* light_cache;
+
+private:
+    // Probability of selecting emitter id from shading position p
+    flt select_pdf(int id, const vec3& p) const;
 };
\ No newline at end of file
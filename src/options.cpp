@@ -0,0 +1,206 @@
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+
+#include "global.hpp"
+#include "image_formats.hpp"
+#include "integrator.hpp"
+#include "options.hpp"
+#include "sampler.hpp"
+
+RenderOptions::RenderOptions()
+    : inputdir("./")
+    , inputname("input")
+    , sample_num(30)
+    , time_budget(0)
+    , formats(1, "jpg")
+    , aov(false)
+    , denoise(false)
+    , checkpoint_interval(0)
+    , resume(false)
+    , part(0)
+    , parts(1)
+    , integrator("path")
+    , sampler("sobol")
+    , blue_noise(false)
+    , memory_budget(0)
+    , tile_size(16)
+    , max_depth(3)
+    , ao_radius(0)
+    , mlt_bootstrap(100000)
+    , mlt_chains(1024)
+    , guiding(false)
+    , caustic_photons(0)
+    , caustic_radius(0)
+    , radiance_cache(false)
+    , cache_cell(0)
+    , cache_error(0.25)
+    , restir(false)
+    , primary_nee(1)
+    , primary_split(1)
+    , adaptive_rr(false)
+    , light_cache(false)
+{
+}
+
+static const char* next_value(int argc, char** argv, int& i)
+{
+    if (i + 1 >= argc)
+        ERRORM("Option %s needs a value\n", argv[i]);
+    return argv[++i];
+}
+
+// mcpt {directory} {name} {sample-number} [--option ...]
+void RenderOptions::parse(int argc, char** argv)
+{
+    int num_positional = 0;
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+        if (arg.compare(0, 2, "--") != 0) {
+            if (num_positional == 0)
+                inputdir = arg;
+            else if (num_positional == 1)
+                inputname = arg;
+            else if (num_positional == 2)
+                sample_num = std::stoi(arg);
+            else
+                ERRORM("Too many arguments: %s\n", arg.c_str());
+            num_positional++;
+            continue;
+        }
+
+        if (arg == "--time") {
+            time_budget = std::stof(next_value(argc, argv, i));
+        } else if (arg == "--snapshots") {
+            std::stringstream list(next_value(argc, argv, i));
+            std::string item;
+            while (std::getline(list, item, ','))
+                snapshots.push_back(std::stoi(item));
+        } else if (arg == "--format") {
+            std::stringstream list(next_value(argc, argv, i));
+            std::string item;
+            formats.clear();
+            while (std::getline(list, item, ',')) {
+                if (!is_image_format(item))
+                    ERRORM("Unknown image format: %s\n", item.c_str());
+                formats.push_back(item);
+            }
+            if (formats.empty())
+                ERRORM("--format needs jpg, pfm or exr\n");
+        } else if (arg == "--aov") {
+            aov = true;
+        } else if (arg == "--denoise") {
+            aov = denoise = true;
+        } else if (arg == "--checkpoint") {
+            checkpoint_interval = std::stof(next_value(argc, argv, i));
+        } else if (arg == "--resume") {
+            resume = true;
+        } else if (arg == "--part") {
+            std::string value = next_value(argc, argv, i);
+            size_t slash = value.find('/');
+            if (slash == std::string::npos)
+                ERRORM("--part needs {part}/{parts}\n");
+            part = std::stoi(value.substr(0, slash));
+            parts = std::stoi(value.substr(slash + 1));
+        } else if (arg == "--connect") {
+            connect = next_value(argc, argv, i);
+        } else if (arg == "--integrator") {
+            integrator = next_value(argc, argv, i);
+        } else if (arg == "--sampler") {
+            sampler = next_value(argc, argv, i);
+        } else if (arg == "--blue-noise") {
+            blue_noise = true;
+        } else if (arg == "--crop") {
+            std::stringstream list(next_value(argc, argv, i));
+            std::string item;
+            while (std::getline(list, item, ','))
+                crop.push_back(std::stoi(item));
+            if (crop.size() != 4)
+                ERRORM("--crop needs x0,y0,x1,y1\n");
+        } else if (arg == "--memory") {
+            memory_budget = std::stof(next_value(argc, argv, i));
+        } else if (arg == "--tile") {
+            tile_size = std::stoi(next_value(argc, argv, i));
+        } else if (arg == "--max-depth") {
+            max_depth = std::stoi(next_value(argc, argv, i));
+        } else if (arg == "--ao-radius") {
+            ao_radius = std::stof(next_value(argc, argv, i));
+        } else if (arg == "--mlt-bootstrap") {
+            mlt_bootstrap = std::stoi(next_value(argc, argv, i));
+        } else if (arg == "--mlt-chains") {
+            mlt_chains = std::stoi(next_value(argc, argv, i));
+        } else if (arg == "--guide") {
+            guiding = true;
+        } else if (arg == "--caustic") {
+            caustic_photons = std::stoi(next_value(argc, argv, i));
+        } else if (arg == "--caustic-radius") {
+            caustic_radius = std::stof(next_value(argc, argv, i));
+        } else if (arg == "--cache") {
+            radiance_cache = true;
+        } else if (arg == "--cache-cell") {
+            cache_cell = std::stof(next_value(argc, argv, i));
+        } else if (arg == "--cache-error") {
+            cache_error = std::stof(next_value(argc, argv, i));
+        } else if (arg == "--restir") {
+            restir = true;
+        } else if (arg == "--nee") {
+            primary_nee = std::stoi(next_value(argc, argv, i));
+        } else if (arg == "--split") {
+            primary_split = std::stoi(next_value(argc, argv, i));
+        } else if (arg == "--adaptive-rr") {
+            adaptive_rr = true;
+        } else if (arg == "--light-cache") {
+            light_cache = true;
+        } else {
+            ERRORM("Unknown option %s\n", arg.c_str());
+        }
+    }
+
+    if (!integrator_registry().count(integrator))
+        ERRORM("Unknown integrator %s\n", integrator.c_str());
+    if (!sampler_registry().count(sampler))
+        ERRORM("Unknown sampler %s\n", sampler.c_str());
+    bool path_only = guiding || caustic_photons > 0 || radiance_cache || restir
+        || primary_nee != 1 || primary_split != 1 || adaptive_rr || light_cache;
+    if (integrator != "path" && integrator != "depth" && path_only)
+        ERRORM("--guide, --caustic, --cache, --restir, --nee, --split, --adaptive-rr and --light-cache only work with the path and depth integrators\n");
+    if (time_budget < 0)
+        ERRORM("--time must not be negative\n");
+    if (checkpoint_interval < 0)
+        ERRORM("--checkpoint must not be negative\n");
+    std::sort(snapshots.begin(), snapshots.end());
+    snapshots.erase(std::unique(snapshots.begin(), snapshots.end()), snapshots.end());
+    if (!snapshots.empty() && snapshots[0] <= 0)
+        ERRORM("--snapshots must be positive\n");
+    if (aov && (integrator == "bdpt" || integrator == "mlt"))
+        ERRORM("--aov and --denoise need a pixel integrator, not %s\n", integrator.c_str());
+    if (parts <= 0 || part < 0 || part >= parts)
+        ERRORM("--part %d/%d is not a part\n", part, parts);
+    if ((parts > 1 || !connect.empty()) && !snapshots.empty())
+        ERRORM("--snapshots do not work with --part and --connect, merge the parts instead\n");
+    if (!crop.empty()) {
+        if (crop[0] < 0 || crop[1] < 0 || crop[2] <= crop[0] || crop[3] <= crop[1])
+            ERRORM("--crop %d,%d,%d,%d is empty\n", crop[0], crop[1], crop[2], crop[3]);
+        if (integrator == "bdpt" || integrator == "mlt" || restir || memory_budget > 0)
+            ERRORM("--crop needs a pixel integrator without --restir and --memory\n");
+    }
+    if (memory_budget < 0)
+        ERRORM("--memory must not be negative\n");
+    if (memory_budget > 0) {
+        if (integrator == "bdpt" || integrator == "mlt" || restir || guiding)
+            ERRORM("--memory needs a pixel integrator without --restir and --guide\n");
+        if (std::find(formats.begin(), formats.end(), "jpg") != formats.end())
+            ERRORM("--memory writes pfm or exr, jpg needs the whole image\n");
+        if (time_budget > 0 || checkpoint_interval > 0 || resume || parts > 1 || !connect.empty() || !snapshots.empty() || denoise)
+            ERRORM("--memory renders every stripe to the end, it does not work with --time, --checkpoint, --resume, --part, --connect, --snapshots and --denoise\n");
+    }
+    if (tile_size < 0)
+        ERRORM("--tile must not be negative\n");
+    if (max_depth <= 0)
+        ERRORM("--max-depth must be positive\n");
+    if (primary_nee <= 0 || primary_split <= 0)
+        ERRORM("--nee and --split must be positive\n");
+    if (mlt_bootstrap <= 0 || mlt_chains <= 0)
+        ERRORM("--mlt-bootstrap and --mlt-chains must be positive\n");
+}
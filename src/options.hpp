@@ -0,0 +1,84 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "global.hpp"
+
+class RenderOptions {
+public:
+    RenderOptions();
+    void parse(int argc, char** argv);
+
+public:
+    std::string inputdir;
+    std::string inputname;
+    int sample_num;
+    // Wall-clock seconds of rendering, 0 renders all the samples
+    flt time_budget;
+    // Sample numbers written to separate images, ascending
+    std::vector<int> snapshots;
+    // Extensions of the images written, jpg, pfm or exr
+    std::vector<std::string> formats;
+    // Accumulate the first-hit albedo, normal and depth beside the radiance
+    bool aov;
+    // Write a denoised image guided by the AOVs as well
+    bool denoise;
+    // Wall-clock seconds between two checkpoints, 0 writes none
+    flt checkpoint_interval;
+    // Continue from the checkpoint of a previous render
+    bool resume;
+    // Part of the samples rendered by this process, written as a partial buffer
+    int part;
+    int parts;
+    // Unix socket of a coordinator handing out the parts
+    std::string connect;
+
+    // Name in integrator_registry()
+    std::string integrator;
+    // Name in sampler_registry()
+    std::string sampler;
+    // Decorrelate the pixels with a blue-noise tile
+    bool blue_noise;
+    // Pixels [crop[0], crop[2]) x [crop[1], crop[3]) of the camera image, empty renders all of it
+    std::vector<int> crop;
+    // Megabytes of framebuffer, the image is rendered in stripes of rows that fit
+    // and written straight to the files, 0 keeps the whole image in memory
+    flt memory_budget;
+    // Side of the tiles rendered by one thread, 0 renders one sample at a time
+    int tile_size;
+    // Vertices traced by the depth integrator
+    int max_depth;
+    // Occlusion distance of the ao integrator, 0 derives it from the scene size
+    flt ao_radius;
+
+    // Bootstrap paths and independent Markov chains of the mlt integrator
+    int mlt_bootstrap;
+    int mlt_chains;
+
+    // Learn and sample an SD-tree for indirect illumination
+    bool guiding;
+
+    // Caustic photons traced per sample, 0 disables the caustic map
+    int caustic_photons;
+    // Initial gather radius, 0 derives it from the scene size
+    flt caustic_radius;
+
+    // Use the radiance cache at secondary diffuse vertices instead of exact paths
+    bool radiance_cache;
+    // Cell size of the cache, 0 derives it from the scene size
+    flt cache_cell;
+    // Relative standard error below which a cell is used
+    flt cache_error;
+
+    // Resample the direct light of the primary hits with reservoirs
+    bool restir;
+
+    // Light samples and continuations at the first diffuse vertex
+    int primary_nee;
+    int primary_split;
+    // Roulette and splitting driven by the radiance cache and the pixel estimate
+    bool adaptive_rr;
+    // Select lights by the contributions learned per region of the scene
+    bool light_cache;
+};
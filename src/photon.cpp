@@ -0,0 +1,189 @@
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "global.hpp"
+#include "material.hpp"
+#include "object.hpp"
+#include "photon.hpp"
+#include "ray.hpp"
+
+// Radius reduction rate, r_{i+1}^2 = r_i^2 * (i + alpha) / (i + 1)
+const flt kAlpha = 2.0f / 3.0f;
+const int kMaxPhotonDepth = 16;
+
+CausticMap::CausticMap()
+    : num_photon(0)
+    , init_radius(0)
+    , radius(0)
+    , cell_size(1)
+{
+}
+
+void CausticMap::init(const EmissiveGroup& egroup, flt init_radius, int photon_per_pass)
+{
+    num_photon = photon_per_pass;
+    this->init_radius = init_radius;
+    radius = init_radius;
+
+    lights.clear();
+    power_sum.clear();
+    flt sum = 0.0f;
+    for (auto emi : egroup.emissive_list) {
+        Triangle* tri = dynamic_cast<Triangle*>(emi);
+        if (!tri)
+            continue;
+        vec3 Ke;
+        tri->mat->type(Ke);
+        sum += (Ke[0] + Ke[1] + Ke[2]) / 3.0f * tri->get_area();
+        lights.push_back(tri);
+        power_sum.push_back(sum);
+    }
+    DEBUGM("caustic map: %zu emitters, radius %f\n", lights.size(), radius);
+}
+
+void CausticMap::trace_photon(const Hittable* world, std::vector<Photon>& out) const
+{
+    flt a = uniform() * power_sum.back();
+    int id = std::lower_bound(power_sum.begin(), power_sum.end(), a) - power_sum.begin();
+    id = std::min(id, static_cast<int>(lights.size()) - 1);
+    const Triangle* tri = lights[id];
+    flt prob = (id == 0 ? power_sum[id] : power_sum[id] - power_sum[id - 1]) / power_sum.back();
+
+    // Cosine weighted emission from the front face
+    vec3 Ke;
+    tri->mat->type(Ke);
+    flt phi = uniform(0, 2 * PI);
+    flt cos_theta = sqrtf(1.0f - uniform());
+    vec3 dir = to_world(angle_to_cartesian(cos_theta, phi), tri->normal);
+    vec3 power = Ke * PI * tri->get_area() / (prob * num_photon);
+
+    Ray ray(tri->sample_point(), dir);
+    HitRecord rec;
+    vec3 foo, wi;
+    bool specular = false;
+    for (int depth = 0; depth < kMaxPhotonDepth; depth++) {
+        if (!world->hit(ray, vec2(kHitEps, INFINITY), rec))
+            return;
+
+        vec3 wo = -ray.direction;
+        if (rec.mat->type(foo) == Material::GLASS) {
+            rec.mat->scatter(wo, rec, wi);
+            power *= rec.mat->bsdf(wo, wi, rec);
+            ray = Ray(rec.p, wi);
+            specular = true;
+            continue;
+        }
+
+        // Only light that went through glass is stored, the rest is
+        // handled by the path tracer
+        if (specular && rec.mat->type(foo) == Material::PHONG) {
+            Photon photon = { rec.p, rec.normal, wo, power };
+            out.push_back(photon);
+        }
+        return;
+    }
+}
+
+void CausticMap::next_pass(const Hittable* world, int now_sample)
+{
+    if (lights.empty())
+        return;
+    // r_n = r_0 * prod_{i=1}^{n} sqrt((i + alpha) / (i + 1)) for sample index n
+    double radius2 = static_cast<double>(init_radius) * init_radius;
+    for (int i = 1; i < now_sample; i++)
+        radius2 *= (i + kAlpha) / (i + 1);
+    radius = sqrt(radius2);
+
+    photons.clear();
+    if (lights.empty() || !(power_sum.back() > 0))
+        return;
+
+#pragma omp parallel
+    {
+        std::vector<Photon> local;
+#pragma omp for schedule(dynamic, 1024)
+        for (int i = 0; i < num_photon; i++) {
+            trace_photon(world, local);
+        }
+#pragma omp critical
+        photons.insert(photons.end(), local.begin(), local.end());
+    }
+
+    build_grid();
+}
+
+unsigned int CausticMap::cell_hash(const ivec3& cell) const
+{
+    unsigned int h = (static_cast<unsigned int>(cell[0]) * 73856093u)
+        ^ (static_cast<unsigned int>(cell[1]) * 19349663u)
+        ^ (static_cast<unsigned int>(cell[2]) * 83492791u);
+    return h & (cell_start.size() - 2);
+}
+
+inline ivec3 to_cell(const vec3& p, flt cell_size)
+{
+    return ivec3(floorf(p[0] / cell_size), floorf(p[1] / cell_size), floorf(p[2] / cell_size));
+}
+
+// Counting sort of the photons by the hash of their cell
+void CausticMap::build_grid()
+{
+    cell_size = 2 * radius;
+    size_t table_size = 1;
+    while (table_size < 2 * photons.size())
+        table_size *= 2;
+    cell_start.assign(table_size + 1, 0);
+
+    std::vector<unsigned int> hash(photons.size());
+    for (size_t i = 0; i < photons.size(); i++) {
+        hash[i] = cell_hash(to_cell(photons[i].p, cell_size));
+        cell_start[hash[i] + 1]++;
+    }
+    for (size_t i = 1; i <= table_size; i++)
+        cell_start[i] += cell_start[i - 1];
+
+    std::vector<int> fill(cell_start.begin(), cell_start.end() - 1);
+    std::vector<Photon> sorted(photons.size());
+    for (size_t i = 0; i < photons.size(); i++)
+        sorted[fill[hash[i]]++] = photons[i];
+    photons.swap(sorted);
+}
+
+vec3 CausticMap::estimate(const HitRecord& rec, const vec3& wo) const
+{
+    vec3 sum(0.0f);
+    if (photons.empty())
+        return sum;
+
+    ivec3 lo = to_cell(rec.p - vec3(radius), cell_size);
+    ivec3 hi = to_cell(rec.p + vec3(radius), cell_size);
+    flt radius2 = radius * radius;
+
+    // Neighbouring cells may share a bucket, visit each bucket once. The sphere spans
+    // two cells per axis, three when the division rounds across a cell boundary.
+    unsigned int visited[27];
+    int num_visited = 0;
+    for (int x = lo[0]; x <= hi[0]; x++) {
+        for (int y = lo[1]; y <= hi[1]; y++) {
+            for (int z = lo[2]; z <= hi[2]; z++) {
+                unsigned int h = cell_hash(ivec3(x, y, z));
+                if (std::find(visited, visited + num_visited, h) != visited + num_visited)
+                    continue;
+                visited[num_visited++] = h;
+
+                for (int i = cell_start[h]; i < cell_start[h + 1]; i++) {
+                    const Photon& photon = photons[i];
+                    vec3 d = photon.p - rec.p;
+                    if (glm::dot(d, d) > radius2 || fabsf(glm::dot(photon.normal, rec.normal)) < 0.5f)
+                        continue;
+                    sum += rec.mat->bsdf(wo, photon.wi, rec) * photon.power;
+                }
+            }
+        }
+    }
+    return sum / (PI * radius2);
+}
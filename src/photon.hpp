@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+
+#include "global.hpp"
+#include "object.hpp"
+#include "ray.hpp"
+
+struct Photon {
+    vec3 p;
+    vec3 normal;
+    // Direction pointing back to where the photon came from
+    vec3 wi;
+    vec3 power;
+};
+
+// Caustic photon map, traced again before every sample so that the estimate is
+// progressive and consistent. The radius shrinks after each pass following
+// Knaus and Zwicker, "Progressive Photon Mapping: A Probabilistic Approach", 2011
+class CausticMap {
+public:
+    CausticMap();
+    void init(const EmissiveGroup& egroup, flt init_radius, int num_photon);
+    // Trace the photons of sample now_sample, the radius follows from the sample
+    // number so that parts and resumed renders continue the same schedule
+    void next_pass(const Hittable* world, int now_sample);
+    // Radiance leaving rec towards wo due to caustic photons
+    vec3 estimate(const HitRecord& rec, const vec3& wo) const;
+
+public:
+    int num_photon;
+    flt init_radius;
+    flt radius;
+    std::vector<Photon> photons;
+
+private:
+    void trace_photon(const Hittable* world, std::vector<Photon>& out) const;
+    void build_grid();
+    unsigned int cell_hash(const ivec3& cell) const;
+
+    // Emitters chosen proportionally to their power
+    std::vector<Triangle*> lights;
+    std::vector<flt> power_sum;
+
+    // Hash grid over the photons, cell size equals the diameter of the gather sphere
+    flt cell_size;
+    std::vector<int> cell_start;
+};
@@ -0,0 +1,121 @@
+
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "global.hpp"
+#include "material.hpp"
+#include "radiance_cache.hpp"
+#include "ray.hpp"
+
+const int kCacheTableBits = 20;
+const int kCacheMaxProbe = 32;
+const flt kCacheMinSamples = 16;
+// Vertices whose specular lobe is sampled more often than this are not cached
+const flt kCacheMaxSpecular = 0.2;
+
+RadianceCache::RadianceCache()
+    : cell_size(1)
+    , max_error(0.25)
+{
+}
+
+void RadianceCache::init(flt size, flt error)
+{
+    cell_size = size;
+    max_error = error;
+
+    size_t table_size = size_t(1) << kCacheTableBits;
+    std::vector<std::atomic<unsigned long long>> empty_keys(table_size);
+    for (auto& key : empty_keys)
+        key.store(0);
+    keys.swap(empty_keys);
+    entries.assign(table_size, Entry());
+    DEBUGM("radiance cache: cell size %f, max error %f\n", cell_size, max_error);
+}
+
+int RadianceCache::cell(const HitRecord& rec)
+{
+    auto phong = dynamic_cast<const PhongMaterial*>(rec.mat);
+    if (!phong)
+        return -1;
+    flt albedo = glm::compMax(phong->albedo(rec));
+    flt specular = glm::compMax(phong->Ks);
+    if (!(albedo > 0) || specular > kCacheMaxSpecular * (specular + albedo))
+        return -1;
+
+    // 20 bits per coordinate, 3 bits for the normal bin, the top bit marks a used key
+    int axis = 0;
+    for (int i = 1; i < 3; i++) {
+        if (fabsf(rec.normal[i]) > fabsf(rec.normal[axis]))
+            axis = i;
+    }
+    unsigned long long key = 1ull << 63;
+    key |= static_cast<unsigned long long>(axis * 2 + (rec.normal[axis] < 0 ? 1 : 0)) << 60;
+    for (int i = 0; i < 3; i++) {
+        long long c = static_cast<long long>(floorf(rec.p[i] / cell_size)) & 0xfffff;
+        key |= static_cast<unsigned long long>(c) << (20 * i);
+    }
+
+    unsigned long long h = key * 0x9e3779b97f4a7c15ull;
+    size_t mask = keys.size() - 1;
+    for (int probe = 0; probe < kCacheMaxProbe; probe++) {
+        size_t id = ((h >> (64 - kCacheTableBits)) + probe) & mask;
+        unsigned long long expected = 0;
+        if (keys[id].load() == key || keys[id].compare_exchange_strong(expected, key) || expected == key)
+            return id;
+    }
+    return -1;
+}
+
+bool RadianceCache::converged(int id) const
+{
+    const Entry& e = entries[id];
+    if (e.count < kCacheMinSamples)
+        return false;
+    flt mean = (e.irradiance[0] + e.irradiance[1] + e.irradiance[2]) / (3.0f * e.count);
+    flt variance = std::max(0.0f, e.lum_sq / e.count - mean * mean);
+    return sqrtf(variance / e.count) <= max_error * std::max(mean, kEps);
+}
+
+vec3 RadianceCache::irradiance(int id) const
+{
+    const Entry& e = entries[id];
+    return vec3(e.irradiance[0], e.irradiance[1], e.irradiance[2]) / std::max(e.count, 1.0f);
+}
+
+flt RadianceCache::samples(int id) const
+{
+    return entries[id].count;
+}
+
+void RadianceCache::record(int id, const vec3& irradiance)
+{
+    Entry& e = entries[id];
+    flt lum = (irradiance[0] + irradiance[1] + irradiance[2]) / 3.0f;
+    for (int i = 0; i < 3; i++) {
+#pragma omp atomic
+        e.irradiance[i] += irradiance[i];
+    }
+#pragma omp atomic
+    e.lum_sq += lum * lum;
+#pragma omp atomic
+    e.count += 1.0f;
+}
+
+void CacheVertex::add(const vec3& contribution)
+{
+    for (int i = 0; i < 3; i++) {
+        if (throughput[i] > 0)
+            radiance[i] += contribution[i] / throughput[i];
+    }
+}
+
+void CacheVertex::commit(RadianceCache& cache) const
+{
+    vec3 irradiance = radiance * cos_over_pdf;
+    if (std::isfinite(irradiance[0]) && std::isfinite(irradiance[1]) && std::isfinite(irradiance[2]))
+        cache.record(cell, irradiance);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+#include "global.hpp"
+#include "ray.hpp"
+
+// Hash grid of indirect irradiance at diffuse vertices, keyed on the position
+// and the dominant axis of the normal. Secondary diffuse vertices may use a
+// converged cell instead of continuing the path.
+class RadianceCache {
+public:
+    struct Entry {
+        flt irradiance[3];
+        flt lum_sq;
+        flt count;
+    };
+
+    RadianceCache();
+    void init(flt cell_size, flt max_error);
+    // Cell of a diffuse vertex, -1 for glossy vertices or when the table is full
+    int cell(const HitRecord& rec);
+    // Enough samples and a small enough relative standard error
+    bool converged(int id) const;
+    vec3 irradiance(int id) const;
+    flt samples(int id) const;
+    void record(int id, const vec3& irradiance);
+
+public:
+    flt cell_size;
+    flt max_error;
+
+private:
+    std::vector<std::atomic<unsigned long long>> keys;
+    std::vector<Entry> entries;
+};
+
+// A path vertex collecting the irradiance estimate of its cell
+struct CacheVertex {
+    int cell;
+    // Path throughput after scattering at this vertex
+    vec3 throughput;
+    vec3 radiance;
+    flt cos_over_pdf;
+
+    void add(const vec3& contribution);
+    void commit(RadianceCache& cache) const;
+};
+
+const int kMaxCacheVertices = 32;
@@ -4,6 +4,7 @@
 
 class Material;
 class Hittable;
+class Emissive;
 
 class Ray {
 public:
@@ -27,4 +28,6 @@ struct HitRecord {
     vec2 uv;
     Material* mat;
     Hittable* obj;
+    // Emitter of light records without a material
+    const Emissive* light;
 };
@@ -0,0 +1,252 @@
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "global.hpp"
+#include "material.hpp"
+#include "restir.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+
+// Light candidates streamed into the reservoir of every primary hit
+const int kInitialCandidates = 32;
+// The reservoir of the previous pass counts at most this many times the new candidates
+const flt kTemporalMaxM = 20;
+const int kSpatialNeighbours = 5;
+const flt kSpatialRadius = 30;
+// Neighbours are only reused on similar surfaces
+const flt kMinNormalCos = 0.9;
+const flt kMaxDepthRatio = 0.1;
+// Sampler streams of the passes, the path of the pixel sample uses stream 0
+const int kCandidateStream = 1;
+const int kSpatialStream = 2;
+
+void Reservoir::reset()
+{
+    light = NULL;
+    p = vec3(0.0f);
+    w_sum = 0;
+    M = 0;
+    W = 0;
+}
+
+bool Reservoir::update(Triangle* sample_light, const vec3& sample_p, flt w, flt m)
+{
+    w_sum += w;
+    M += m;
+    if (w > 0 && uniform() * w_sum <= w) {
+        light = sample_light;
+        p = sample_p;
+        return true;
+    }
+    return false;
+}
+
+ReSTIR::ReSTIR()
+    : width(0)
+    , height(0)
+    , pass(0)
+{
+}
+
+void ReSTIR::init(Scene& scene)
+{
+    lights.clear();
+    for (auto emi : scene.egroup.emissive_list) {
+        Triangle* tri = dynamic_cast<Triangle*>(emi);
+        if (tri)
+            lights.push_back(tri);
+    }
+    // Reservoirs only hold points on triangles, the path tracer keeps sampling other lights
+    if (lights.size() != scene.egroup.emissive_list.size()) {
+        INFO("ReSTIR only supports emissive triangles, using plain light sampling\n");
+        lights.clear();
+    }
+
+    width = scene.buffer.width;
+    height = scene.buffer.height;
+    pass = 0;
+    current.assign(width * height, PrimaryHit());
+    previous.assign(width * height, PrimaryHit());
+    spatial.assign(width * height, Reservoir());
+}
+
+const Ray& ReSTIR::ray(int x, int y) const
+{
+    return current[y * width + x].ray;
+}
+
+const vec3* ReSTIR::direct(int x, int y) const
+{
+    const PrimaryHit& hit = current[y * width + x];
+    return hit.valid ? &hit.direct : NULL;
+}
+
+// Light transported from p to the primary hit, without the visibility
+vec3 ReSTIR::unshadowed(const PrimaryHit& hit, Triangle* light, const vec3& p) const
+{
+    vec3 d = p - hit.rec.p;
+    flt dist2 = glm::dot(d, d);
+    vec3 wi = d / sqrtf(dist2);
+    flt cos_surface = glm::dot(wi, hit.rec.normal);
+    flt cos_light = -glm::dot(wi, light->normal);
+    if (cos_surface <= 0 || cos_light <= 0 || !(dist2 > 0))
+        return vec3(0.0f);
+
+    vec3 Ke;
+    light->mat->type(Ke);
+    return Ke * hit.rec.mat->bsdf(hit.wo, wi, hit.rec) * (cos_surface * cos_light / dist2);
+}
+
+flt ReSTIR::target(const PrimaryHit& hit, Triangle* light, const vec3& p) const
+{
+    return luminance(unshadowed(hit, light, p));
+}
+
+bool ReSTIR::similar(const PrimaryHit& a, const PrimaryHit& b) const
+{
+    return glm::dot(a.rec.normal, b.rec.normal) >= kMinNormalCos
+        && fabsf(a.rec.t - b.rec.t) <= kMaxDepthRatio * b.rec.t;
+}
+
+// Pick an emitter uniformly and a point uniformly on it, resampled by the unshadowed contribution
+void ReSTIR::initial_candidates(PrimaryHit& hit) const
+{
+    Reservoir& r = hit.reservoir;
+    r.reset();
+    int n = lights.size();
+    for (int i = 0; i < kInitialCandidates; i++) {
+        int id = std::min(static_cast<int>(uniform() * n), n - 1);
+        Triangle* light = lights[id];
+        vec3 p = light->sample_point();
+        flt source_pdf = 1.0f / (n * light->get_area());
+        r.update(light, p, target(hit, light, p) / source_pdf, 1);
+    }
+    flt p_hat = r.light ? target(hit, r.light, r.p) : 0;
+    r.W = p_hat > 0 ? r.w_sum / (r.M * p_hat) : 0;
+}
+
+// Merge the reservoirs of the inputs into the domain of hit. M overrides the
+// sample counts of the inputs. The 1/Z normalization counts the inputs that
+// could have produced the selected sample, which keeps the result unbiased.
+void ReSTIR::combine(const PrimaryHit& hit, const PrimaryHit* const* inputs, const flt* M, int num_input, Reservoir& out) const
+{
+    out.reset();
+    for (int i = 0; i < num_input; i++) {
+        const Reservoir& r = inputs[i]->reservoir;
+        if (r.light && r.W > 0)
+            out.update(r.light, r.p, target(hit, r.light, r.p) * r.W * M[i], M[i]);
+        else
+            out.M += M[i];
+    }
+    if (!out.light)
+        return;
+
+    flt Z = 0;
+    for (int i = 0; i < num_input; i++) {
+        if (target(*inputs[i], out.light, out.p) > 0)
+            Z += M[i];
+    }
+    flt p_hat = target(hit, out.light, out.p);
+    out.W = (p_hat > 0 && Z > 0) ? out.w_sum / (Z * p_hat) : 0;
+}
+
+void ReSTIR::next_pass(Scene& scene, int now_sample)
+{
+    std::swap(current, previous);
+
+    // Primary hits, new candidates and reuse of the previous pass
+#pragma omp parallel
+    {
+        std::unique_ptr<Sampler> sampler = create_sampler(scene.options);
+        ScopedSampler scoped(*sampler);
+#pragma omp for schedule(dynamic)
+        for (int y_t = 0; y_t < height; y_t++) {
+            for (int x_t = 0; x_t < width; x_t++) {
+                sampler->start_pixel(x_t, y_t, now_sample - 1, kCandidateStream);
+                PrimaryHit& hit = current[y_t * width + x_t];
+                hit.ray = scene.camera.cast_ray(x_t, y_t);
+                hit.valid = false;
+                vec3 emissive_color;
+                if (lights.empty() || !scene.bvh_root->hit(hit.ray, vec2(kHitEps, INFINITY), hit.rec)
+                    || hit.rec.mat->type(emissive_color) != Material::PHONG)
+                    continue;
+
+                hit.valid = true;
+                hit.wo = -hit.ray.direction;
+                hit.rec.normal = glm::dot(hit.rec.normal, hit.wo) > 0 ? hit.rec.normal : -hit.rec.normal;
+                initial_candidates(hit);
+
+                const PrimaryHit& prev = previous[y_t * width + x_t];
+                if (pass > 0 && prev.valid && similar(hit, prev)) {
+                    const PrimaryHit* inputs[2] = { &hit, &prev };
+                    flt M[2] = { hit.reservoir.M, std::min(prev.reservoir.M, kTemporalMaxM * hit.reservoir.M) };
+                    Reservoir r;
+                    combine(hit, inputs, M, 2, r);
+                    hit.reservoir = r;
+                }
+            }
+        }
+    }
+
+    // Reuse of neighbouring pixels
+#pragma omp parallel
+    {
+        std::unique_ptr<Sampler> sampler = create_sampler(scene.options);
+        ScopedSampler scoped(*sampler);
+#pragma omp for schedule(dynamic)
+        for (int y_t = 0; y_t < height; y_t++) {
+            for (int x_t = 0; x_t < width; x_t++) {
+                sampler->start_pixel(x_t, y_t, now_sample - 1, kSpatialStream);
+                const PrimaryHit& hit = current[y_t * width + x_t];
+                if (!hit.valid)
+                    continue;
+
+                const PrimaryHit* inputs[kSpatialNeighbours + 1] = { &hit };
+                flt M[kSpatialNeighbours + 1] = { hit.reservoir.M };
+                int num_input = 1;
+                for (int i = 0; i < kSpatialNeighbours; i++) {
+                    flt radius = kSpatialRadius * sqrtf(uniform());
+                    flt phi = 2 * PI * uniform();
+                    int x = x_t + static_cast<int>(roundf(radius * cosf(phi)));
+                    int y = y_t + static_cast<int>(roundf(radius * sinf(phi)));
+                    if (x < 0 || x >= width || y < 0 || y >= height || (x == x_t && y == y_t))
+                        continue;
+                    const PrimaryHit& neighbour = current[y * width + x];
+                    if (neighbour.valid && similar(hit, neighbour)) {
+                        inputs[num_input] = &neighbour;
+                        M[num_input++] = neighbour.reservoir.M;
+                    }
+                }
+                combine(hit, inputs, M, num_input, spatial[y_t * width + x_t]);
+            }
+        }
+    }
+
+    // A single shadow ray to the selected light point. Occluded samples stay in the
+    // reservoir, dropping them for the next pass would darken the penumbrae.
+#pragma omp parallel for schedule(dynamic)
+    for (int y_t = 0; y_t < height; y_t++) {
+        for (int x_t = 0; x_t < width; x_t++) {
+            PrimaryHit& hit = current[y_t * width + x_t];
+            if (!hit.valid)
+                continue;
+            hit.reservoir = spatial[y_t * width + x_t];
+            hit.direct = vec3(0.0f);
+
+            const Reservoir& r = hit.reservoir;
+            if (!r.light || !(r.W > 0))
+                continue;
+            HitRecord rec;
+            flt dist = glm::length(r.p - hit.rec.p);
+            if (scene.bvh_root->hit(Ray(hit.rec.p, r.p - hit.rec.p), vec2(kHitEps, dist - kHitEps), rec))
+                continue;
+            hit.direct = unshadowed(hit, r.light, r.p) * r.W;
+        }
+    }
+    pass++;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <vector>
+
+#include "global.hpp"
+#include "object.hpp"
+#include "ray.hpp"
+
+class Scene;
+
+// Weighted reservoir holding one light sample
+struct Reservoir {
+    Triangle* light;
+    vec3 p;
+    flt w_sum;
+    flt M;
+    // Unbiased contribution weight of the selected sample
+    flt W;
+
+    void reset();
+    // Stream a sample with resampling weight w, standing for m candidates
+    bool update(Triangle* sample_light, const vec3& sample_p, flt w, flt m);
+};
+
+struct PrimaryHit {
+    Ray ray;
+    bool valid;
+    HitRecord rec;
+    vec3 wo;
+    Reservoir reservoir;
+    // Shaded direct light, including the visibility
+    vec3 direct;
+};
+
+// Reservoir resampled direct lighting at the primary hits, with reuse across
+// samples and from neighbouring pixels. One shadow ray per pixel and pass.
+// Bitterli et al., "Spatiotemporal reservoir resampling for real-time ray tracing
+// with dynamic direct lighting", 2020
+class ReSTIR {
+public:
+    ReSTIR();
+    void init(Scene& scene);
+    // Trace the primary rays of sample now_sample and resample their direct light
+    void next_pass(Scene& scene, int now_sample);
+    const Ray& ray(int x, int y) const;
+    // Direct light of the primary hit, NULL when the path tracer has to sample it
+    const vec3* direct(int x, int y) const;
+
+private:
+    void initial_candidates(PrimaryHit& hit) const;
+    void combine(const PrimaryHit& hit, const PrimaryHit* const* inputs, const flt* M, int num_input, Reservoir& out) const;
+    vec3 unshadowed(const PrimaryHit& hit, Triangle* light, const vec3& p) const;
+    flt target(const PrimaryHit& hit, Triangle* light, const vec3& p) const;
+    bool similar(const PrimaryHit& a, const PrimaryHit& b) const;
+
+public:
+    std::vector<Triangle*> lights;
+
+private:
+    int width, height;
+    int pass;
+    std::vector<PrimaryHit> current, previous;
+    std::vector<Reservoir> spatial;
+};
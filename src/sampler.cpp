@@ -0,0 +1,229 @@
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "blue_noise.hpp"
+#include "global.hpp"
+#include "options.hpp"
+#include "sampler.hpp"
+
+// Low bits of the sample seed hold the stream id
+const uint64_t kStreamBits = 8;
+
+// splitmix64 finalizer
+static uint64_t mix_bits(uint64_t v)
+{
+    v ^= v >> 31;
+    v *= 0x7fb5d329728ea185ull;
+    v ^= v >> 27;
+    v *= 0x81dadef4bc2dd44dull;
+    v ^= v >> 33;
+    return v;
+}
+
+static uint32_t hash_seed(uint64_t seed, uint64_t a, uint64_t b = 0)
+{
+    return static_cast<uint32_t>(mix_bits(seed ^ mix_bits(a ^ mix_bits(b))));
+}
+
+static flt to_float(uint32_t v)
+{
+    return (v >> 8) * (1.0f / 16777216.0f);
+}
+
+static uint32_t reverse_bits(uint32_t v)
+{
+    v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+    v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+    v = ((v >> 4) & 0x0f0f0f0fu) | ((v & 0x0f0f0f0fu) << 4);
+    v = ((v >> 8) & 0x00ff00ffu) | ((v & 0x00ff00ffu) << 8);
+    return (v >> 16) | (v << 16);
+}
+
+// Permutation of [0, n) selected by seed, Kensler 2013 "Correlated Multi-Jittered Sampling"
+static uint32_t permute(uint32_t i, uint32_t n, uint32_t seed)
+{
+    uint32_t w = n - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= seed;
+        i *= 0xe170893d;
+        i ^= seed >> 16;
+        i ^= (i & w) >> 4;
+        i ^= seed >> 8;
+        i *= 0x0929eb3f;
+        i ^= seed >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | seed >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= n);
+    return (i + seed) % n;
+}
+
+// Hash based Owen scrambling, Burley 2020 "Practical Hash-based Owen Scrambling"
+static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+{
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+// First two dimensions of the Sobol sequence
+static uint32_t sobol(uint32_t index, int dim)
+{
+    uint32_t x = 0;
+    uint32_t v = 1u << 31;
+    for (int bit = 0; index; bit++, index >>= 1) {
+        if (index & 1)
+            x ^= dim == 0 ? (1u << (31 - bit)) : v;
+        v ^= v >> 1;
+    }
+    return x;
+}
+
+Sampler::Sampler()
+    : blue_noise(NULL)
+    , pixel_seed(0)
+    , sample_index(0)
+    , dimension(0)
+    , pixel_x(0)
+    , pixel_y(0)
+{
+}
+
+uint64_t Sampler::pixel_key(int x, int y) const
+{
+    if (blue_noise)
+        return 0;
+    return (static_cast<uint64_t>(static_cast<uint32_t>(y)) << 32) | static_cast<uint32_t>(x);
+}
+
+void Sampler::start_pixel(int x, int y, int index, int stream)
+{
+    pixel_seed = mix_bits(pixel_key(x, y)) ^ mix_bits(static_cast<uint64_t>(stream) + 1);
+    sample_index = index;
+    dimension = 0;
+    pixel_x = x;
+    pixel_y = y;
+}
+
+void Sampler::start_dimension(int dim)
+{
+    dimension = std::max(dimension, dim);
+}
+
+flt Sampler::next()
+{
+    flt u = sample(dimension);
+    if (blue_noise) {
+        // Every dimension looks up the tile at another toroidal offset
+        uint32_t offset = hash_seed(0, dimension);
+        u += blue_noise->value(pixel_x + (offset & 0xffff), pixel_y + (offset >> 16));
+        u -= floorf(u);
+    }
+    dimension++;
+    return u;
+}
+
+void IndependentSampler::start_pixel(int x, int y, int index, int stream)
+{
+    Sampler::start_pixel(x, y, index, stream);
+    uint64_t pixel = pixel_key(x, y);
+    uint64_t sample = (static_cast<uint64_t>(static_cast<uint32_t>(index)) << kStreamBits) | static_cast<uint32_t>(stream);
+    rng.seed(mix_bits(sample), mix_bits(pixel));
+}
+
+flt IndependentSampler::sample(int dim)
+{
+    return rng.next_float();
+}
+
+StratifiedSampler::StratifiedSampler(int num_samples)
+    : num_samples(std::max(num_samples, 1))
+{
+}
+
+flt StratifiedSampler::sample(int dim)
+{
+    // Samples past num_samples start another stratification
+    uint32_t round = sample_index / num_samples;
+    uint32_t stratum = permute(sample_index % num_samples, num_samples, hash_seed(pixel_seed, dim, round));
+    flt jitter = to_float(hash_seed(pixel_seed, dim, (static_cast<uint64_t>(sample_index) << 32) | 0xffffffffu));
+    return std::min((stratum + jitter) / num_samples, 1.0f - kEps);
+}
+
+flt SobolSampler::sample(int dim)
+{
+    uint32_t seed = hash_seed(pixel_seed, dim / 2);
+    uint32_t index = nested_uniform_scramble(sample_index, seed);
+    uint32_t x = sobol(index, dim & 1);
+    x = nested_uniform_scramble(x, hash_seed(seed, dim & 1));
+    return to_float(x);
+}
+
+ScopedSampler::ScopedSampler(Sampler& sampler)
+    : previous(random_source())
+{
+    random_source() = &sampler;
+}
+
+ScopedSampler::~ScopedSampler()
+{
+    random_source() = previous;
+}
+
+static Sampler* make_independent(const RenderOptions& options)
+{
+    return new IndependentSampler();
+}
+
+static Sampler* make_stratified(const RenderOptions& options)
+{
+    return new StratifiedSampler(options.sample_num);
+}
+
+static Sampler* make_sobol(const RenderOptions& options)
+{
+    return new SobolSampler();
+}
+
+const std::map<std::string, SamplerFactory>& sampler_registry()
+{
+    static const std::map<std::string, SamplerFactory> registry = {
+        { "independent", make_independent },
+        { "stratified", make_stratified },
+        { "sobol", make_sobol },
+    };
+    return registry;
+}
+
+std::unique_ptr<Sampler> create_sampler(const RenderOptions& options)
+{
+    auto it = sampler_registry().find(options.sampler);
+    if (it == sampler_registry().end())
+        ERRORM("Unknown sampler %s\n", options.sampler.c_str());
+    std::unique_ptr<Sampler> sampler(it->second(options));
+    if (options.blue_noise)
+        sampler->blue_noise = &BlueNoise::tile();
+    return sampler;
+}
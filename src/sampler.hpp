@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "global.hpp"
+
+class BlueNoise;
+class RenderOptions;
+
+// Random numbers of one pixel sample, installed with random_source() for uniform().
+// The numbers only depend on the pixel, the sample index, a stream id and the
+// dimension, so renders do not depend on the thread count or the OpenMP scheduling.
+class Sampler : public RandomSource {
+public:
+    Sampler();
+    virtual ~Sampler() { }
+    virtual void start_pixel(int x, int y, int sample_index, int stream = 0);
+    // Dimensions never go back within a pixel sample, so that split paths and
+    // repeated light samples do not reuse the same numbers
+    virtual void start_dimension(int dim) override;
+    virtual flt next() override;
+
+public:
+    // With a tile, all the pixels share the same sequence, rotated per pixel and
+    // dimension by the blue noise (Cranley-Patterson), so that the error of
+    // neighbouring pixels is anti-correlated
+    const BlueNoise* blue_noise;
+
+protected:
+    // Component dim of the current pixel sample
+    virtual flt sample(int dim) = 0;
+    uint64_t pixel_key(int x, int y) const;
+
+protected:
+    uint64_t pixel_seed;
+    uint32_t sample_index;
+    int dimension;
+    int pixel_x, pixel_y;
+};
+
+// PCG32 stream per pixel sample, consumed in order whatever the dimension
+class IndependentSampler : public Sampler {
+public:
+    virtual void start_pixel(int x, int y, int sample_index, int stream = 0) override;
+
+protected:
+    virtual flt sample(int dim) override;
+
+private:
+    PCG32 rng;
+};
+
+// Every dimension is a jittered stratification of [0, 1) into num_samples strata,
+// shuffled independently per pixel and dimension (Latin hypercube)
+class StratifiedSampler : public Sampler {
+public:
+    StratifiedSampler(int num_samples);
+
+protected:
+    virtual flt sample(int dim) override;
+
+private:
+    uint32_t num_samples;
+};
+
+// Pairs of dimensions from the 2D Sobol sequence with nested uniform (Owen)
+// scrambling and a shuffled index per pair (Burley 2020)
+class SobolSampler : public Sampler {
+protected:
+    virtual flt sample(int dim) override;
+};
+
+// Installs a sampler as the random source of the current thread
+class ScopedSampler {
+public:
+    ScopedSampler(Sampler& sampler);
+    ~ScopedSampler();
+
+private:
+    RandomSource* previous;
+};
+
+typedef Sampler* (*SamplerFactory)(const RenderOptions& options);
+
+// Samplers selectable with --sampler
+const std::map<std::string, SamplerFactory>& sampler_registry();
+std::unique_ptr<Sampler> create_sampler(const RenderOptions& options);
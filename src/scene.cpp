@@ -17,8 +17,12 @@
 #include "tiny_obj_loader.h"
 
 #include "buffer.hpp"
+#include "image_writer.hpp"
 #include "bvh.hpp"
 #include "camera.hpp"
+#include "checkpoint.hpp"
+#include "distributed.hpp"
+#include "image_formats.hpp"
 #include "global.hpp"
 #include "scene.hpp"
 
@@ -46,10 +50,13 @@ void read_materials(const std::vector<tinyobj::material_t>& materi_list,
     // Obtain all the light arguments in xml file
     std::map<std::string, vec3> light_map;
     auto light_xmlnode = xmlconfig.FirstChildElement("light");
-    if (!light_xmlnode) {
-        ERRORM("No light source found in xml file\n");
-    }
     while (light_xmlnode) {
+        // Analytic lights are read by read_lights
+        auto type = light_xmlnode->Attribute("type");
+        if (type && std::string(type) != "mesh") {
+            light_xmlnode = light_xmlnode->NextSiblingElement("light");
+            continue;
+        }
         auto foo = light_xmlnode->Attribute("mtlname");
         if (!foo) {
             ERRORM("light has no attribute name \"mtlname\"\n");
@@ -127,6 +134,64 @@ void read_materials(const std::vector<tinyobj::material_t>& materi_list,
     DEBUGM("material num: %d\n", mat_ptr_list.size());
 }
 
+vec3 read_vec3(const tinyxml2::XMLElement* xmlnode, const char* name)
+{
+    auto str = xmlnode->Attribute(name);
+    if (!str) {
+        ERRORM("light has no attribute name \"%s\"\n", name);
+    }
+    vec3 value;
+    if (sscanf(str, "%f,%f,%f", &value[0], &value[1], &value[2]) != 3) {
+        ERRORM("cannot read 3 floats in %s attribute\n", name);
+    }
+    return value;
+}
+
+// Point, spot and quad lights declared in the xml file
+//   <light type="point" position="x,y,z" intensity="r,g,b"/>
+//   <light type="spot" position="x,y,z" direction="x,y,z" intensity="r,g,b" angle="30" inner="20"/>
+//   <light type="quad" corner="x,y,z" u="x,y,z" v="x,y,z" radiance="r,g,b"/>
+// Angles are half angles of the cone in degrees, the edges u and v of a quad must be orthogonal.
+void read_lights(const tinyxml2::XMLDocument& xmlconfig, std::vector<Emissive*>& light_objects)
+{
+    auto light_xmlnode = xmlconfig.FirstChildElement("light");
+    for (; light_xmlnode; light_xmlnode = light_xmlnode->NextSiblingElement("light")) {
+        auto type_str = light_xmlnode->Attribute("type");
+        if (!type_str || std::string(type_str) == "mesh")
+            continue;
+        std::string type(type_str);
+
+        if (type == "point") {
+            vec3 position = read_vec3(light_xmlnode, "position");
+            vec3 intensity = read_vec3(light_xmlnode, "intensity");
+            light_objects.push_back(new PointLight(position, intensity));
+            DEBUGM("point light: %f %f %f\n", position[0], position[1], position[2]);
+        } else if (type == "spot") {
+            vec3 position = read_vec3(light_xmlnode, "position");
+            vec3 direction = read_vec3(light_xmlnode, "direction");
+            vec3 intensity = read_vec3(light_xmlnode, "intensity");
+            flt angle = 30.0f;
+            light_xmlnode->QueryFloatAttribute("angle", &angle);
+            flt inner = angle;
+            light_xmlnode->QueryFloatAttribute("inner", &inner);
+            light_objects.push_back(new SpotLight(position, direction, intensity, angle * PI / 180, inner * PI / 180));
+            DEBUGM("spot light: %f %f %f  angle: %f\n", position[0], position[1], position[2], angle);
+        } else if (type == "quad") {
+            vec3 corner = read_vec3(light_xmlnode, "corner");
+            vec3 u = read_vec3(light_xmlnode, "u");
+            vec3 v = read_vec3(light_xmlnode, "v");
+            vec3 radiance = read_vec3(light_xmlnode, "radiance");
+            if (fabsf(glm::dot(u, v)) > 1e-3f * glm::length(u) * glm::length(v)) {
+                ERRORM("edges of quad light are not orthogonal\n");
+            }
+            light_objects.push_back(new QuadLight(corner, u, v, radiance));
+            DEBUGM("quad light: %f %f %f\n", corner[0], corner[1], corner[2]);
+        } else {
+            ERRORM("unknown light type %s\n", type.c_str());
+        }
+    }
+}
+
 void save_obj_and_mat(const std::vector<tinyobj::shape_t>& shapes,
     const tinyobj::attrib_t& attrib,
     const std::vector<Material*>& materials,
@@ -207,6 +272,8 @@ void save_obj_and_mat(const std::vector<tinyobj::shape_t>& shapes,
 }
 
 Scene::Scene(const std::string& objdir, const std::string& objname)
+    : first_sample(1)
+    , max_depth(0)
 {
     tinyobj::ObjReader reader;
     read_objfile(objdir + objname + ".obj", reader);
@@ -234,9 +301,27 @@ Scene::Scene(const std::string& objdir, const std::string& objname)
     save_obj_and_mat(shapes, attrib, this->materials,
         this->objects, light_objects);
 
-    this->egroup.init(light_objects);
+    read_lights(xmlconfig, light_objects);
+
+    // Optional environment map, <envmap file="sky.hdr" scale="1"/>
+    EnvironmentMap* envmap = NULL;
+    auto env_xmlnode = xmlconfig.FirstChildElement("envmap");
+    if (env_xmlnode) {
+        auto file = env_xmlnode->Attribute("file");
+        if (!file) {
+            ERRORM("envmap has no attribute name \"file\"\n");
+        }
+        flt scale = 1.0f;
+        env_xmlnode->QueryFloatAttribute("scale", &scale);
+        envmap = new EnvironmentMap();
+        envmap->init(objdir + file, scale);
+    }
+    if (light_objects.empty() && !envmap) {
+        ERRORM("No light source found in the scene\n");
+    }
+
+    this->egroup.init(light_objects, envmap);
     this->camera.init(xmlconfig);
-    this->buffer.init(this->camera.width, this->camera.height);
 
     INFO("Image size: %d x %d (W x H)\n", camera.width, camera.height);
     // bvhtree
@@ -262,13 +347,85 @@ bool Scene::hit(const Ray& ray, const vec2& t_range, HitRecord& rec)
     return flag;
 }
 
+// Classic Russian roulette starts at this bounce
+const int kRouletteBounce = 3;
+// Adaptive roulette and splitting keep the expected contribution of a path within a
+// weight window around the pixel estimate, after Vorba and Krivanek, "Adjoint-Driven
+// Russian Roulette and Splitting in Light Transport Simulation", 2016
+const flt kWeightWindow = 5;
+const int kMaxSplit = 4;
+const flt kMinSurvival = 0.05;
+const flt kAdaptiveMinSamples = 16;
+const int kMaxPathBranches = 32;
+// Sampler dimensions of a path: the camera ray, then a block per vertex holding the
+// light sample with its MIS bsdf sample, adaptive roulette, scattering and roulette
+const int kCameraDimensions = 2;
+const int kBounceDimensions = 16;
+const int kLightDimension = 0;
+const int kSurvivalDimension = 8;
+const int kScatterDimension = 10;
+const int kRouletteDimension = 14;
+// Samples between two progress images
+const int kProgressInterval = 5;
+
+void PathStats::reset()
+{
+    paths = rays = light_samples = splits = kills = 0;
+}
+
+void PathStats::add(const PathStats& other)
+{
+    paths += other.paths;
+    rays += other.rays;
+    light_samples += other.light_samples;
+    splits += other.splits;
+    kills += other.kills;
+}
+
+void PathStats::report() const
+{
+    if (paths == 0)
+        return;
+    INFO("paths: %lld, rays per path: %.3f, light samples per path: %.3f, splits: %lld, roulette kills: %lld\n",
+        paths, 1.0 * rays / paths, 1.0 * light_samples / paths, splits, kills);
+}
+
 inline flt power_heuristic(flt f, flt g)
 {
     return (f * f) / (f * f + g * g);
 }
 
+// Sample a scattering direction, mixing BSDF sampling with the guiding
+// distribution of the region when it is available. Returns the combined pdf.
+flt Scene::scatter(const vec3& wo, const HitRecord& rec, vec3& wi, const DTreeWrapper* dtree)
+{
+    if (!dtree || !guide.ready())
+        return rec.mat->scatter(wo, rec, wi);
+
+    flt fraction = guide.bsdf_fraction;
+    if (uniform() < fraction) {
+        flt bsdf_pdf = rec.mat->scatter(wo, rec, wi);
+        if (bsdf_pdf <= 0.0f)
+            return 0.0f;
+        return fraction * bsdf_pdf + (1.0f - fraction) * dtree->pdf(wi);
+    }
+
+    flt guide_pdf;
+    wi = dtree->sample(guide_pdf);
+    return fraction * rec.mat->pdf(wo, rec, wi) + (1.0f - fraction) * guide_pdf;
+}
+
+flt Scene::scatter_pdf(const vec3& wo, const HitRecord& rec, const vec3& wi, const DTreeWrapper* dtree)
+{
+    if (!dtree || !guide.ready())
+        return rec.mat->pdf(wo, rec, wi);
+
+    flt fraction = guide.bsdf_fraction;
+    return fraction * rec.mat->pdf(wo, rec, wi) + (1.0f - fraction) * dtree->pdf(wi);
+}
+
 // MIS light sample
-vec3 Scene::sample_light(const HitRecord& rec, const vec3& wo, const Hittable* world)
+vec3 Scene::sample_light(const HitRecord& rec, const vec3& wo, const Hittable* world, const DTreeWrapper* dtree)
 {
     HitRecord light_rec;
     vec3 wi;
@@ -279,24 +436,22 @@ vec3 Scene::sample_light(const HitRecord& rec, const vec3& wo, const Hittable* w
     // sample light
     light_pdf = egroup.sample_ray(rec, world, light_rec, wi);
     if (light_pdf > 0.0f) {
-        bsdf_pdf = rec.mat->pdf(wo, rec, wi);
+        bsdf_pdf = scatter_pdf(wo, rec, wi, dtree);
         if (bsdf_pdf > 0.0f) {
             bsdf = rec.mat->bsdf(wo, wi, rec);
-            if (!light_rec.mat->type(Li) == Material::LIGHT)
-                ERRORM("Not an emissive!\n");
-            weight = power_heuristic(light_pdf, bsdf_pdf);
+            Li = egroup.radiance(light_rec, wi);
+            weight = egroup.is_delta(light_rec) ? 1.0f : power_heuristic(light_pdf, bsdf_pdf);
 
             color += Li * bsdf * glm::dot(wi, rec.normal) * weight / light_pdf;
         }
     }
     // sample bsdf
-    bsdf_pdf = rec.mat->scatter(wo, rec, wi);
+    bsdf_pdf = scatter(wo, rec, wi, dtree);
     if (bsdf_pdf > 0.0f) {
         light_pdf = egroup.pdf(Ray(rec.p, wi), world, light_rec);
         if (light_pdf > 0.0f) {
             bsdf = rec.mat->bsdf(wo, wi, rec);
-            if (!light_rec.mat->type(Li) == Material::LIGHT)
-                ERRORM("Not an emissive!\n");
+            Li = egroup.radiance(light_rec, wi);
             weight = power_heuristic(bsdf_pdf, light_pdf);
 
             color += Li * bsdf * glm::dot(wi, rec.normal) * weight / bsdf_pdf;
@@ -305,8 +460,23 @@ vec3 Scene::sample_light(const HitRecord& rec, const vec3& wo, const Hittable* w
     return color;
 }
 
+// A continuation of a split path vertex, traced after the current branch
+struct PathBranch {
+    Ray ray;
+    vec3 throughput;
+    int bounce;
+    // Vertices shared with the other branches of the split
+    int num_vertices;
+    int num_cache_vertices;
+    // Vertices recording the direction of this branch
+    bool has_vertex;
+    GuideVertex vertex;
+    bool has_cache_vertex;
+    CacheVertex cache_vertex;
+};
+
 // https://computergraphics.stackexchange.com/questions/5152/progressive-path-tracing-with-explicit-light-sampling
-vec3 Scene::Li(const Ray& init_ray, const Hittable* world)
+vec3 Scene::Li(const Ray& init_ray, const Hittable* world, const vec3* primary_direct, flt pixel_estimate)
 {
     vec3 color(0.0f);
     vec3 throughput(1.0f);
@@ -316,76 +486,454 @@ vec3 Scene::Li(const Ray& init_ray, const Hittable* world)
     HitRecord rec;
     const flt Krr = 0.8;
     bool emissive_flag = true;
+    PathStats path_stats = {};
+    path_stats.paths = 1;
+
+    // Vertices whose incident radiance trains the guiding distribution
+    GuideVertex vertices[kMaxGuideVertices];
+    int num_vertices = 0;
+    // Vertices whose irradiance feeds the radiance cache
+    CacheVertex cache_vertices[kMaxCacheVertices];
+    int num_cache_vertices = 0;
+    // Continuations waiting for the current branch to finish
+    PathBranch branches[kMaxPathBranches];
+    int num_branches = 0;
+
+    auto add_contribution = [&](const vec3& contribution) {
+        color += contribution;
+        for (int i = 0; i < num_vertices; i++)
+            vertices[i].add(contribution);
+        for (int i = 0; i < num_cache_vertices; i++)
+            cache_vertices[i].add(contribution);
+    };
+
+    auto start_branch = [&](const PathBranch& branch) {
+        ray = branch.ray;
+        throughput = branch.throughput;
+        if (branch.has_vertex)
+            vertices[num_vertices++] = branch.vertex;
+        if (branch.has_cache_vertex)
+            cache_vertices[num_cache_vertices++] = branch.cache_vertex;
+    };
+
+    int bounce = 0;
+    auto start_dimension = [&](int offset) {
+        sample_dimension(kCameraDimensions + bounce * kBounceDimensions + offset);
+    };
+
+    while (true) {
+        for (;; bounce++) {
+            path_stats.rays++;
+            bool hit = world->hit(ray, vec2(kHitEps, INFINITY), rec);
+            if (emissive_flag && !egroup.quads.empty())
+                color += throughput * egroup.emission(ray, hit ? rec.t : INFINITY);
+            if (hit == false) {
+                // Escaped rays see the environment, light sampling accounts for it after a diffuse vertex
+                if (emissive_flag && egroup.envmap)
+                    color += throughput * egroup.envmap->Le(ray.direction);
+                break;
+            }
 
-    for (int bounce = 0;; bounce++) {
-        if (world->hit(ray, vec2(kHitEps, INFINITY), rec) == false) {
-            // No ray and object intersection, return black
-            break;
-        }
+            wo = -ray.direction;
 
-        wo = -ray.direction;
+            // material self emissive
+            if (rec.mat->type(emissive_color) == Material::LIGHT) {
+                if (emissive_flag && glm::dot(rec.normal, ray.direction) < 0)
+                    color += throughput * emissive_color;
+                break;
+            }
 
-        // material self emissive
-        if (rec.mat->type(emissive_color) == Material::LIGHT) {
-            if (emissive_flag && glm::dot(rec.normal, ray.direction) < 0)
-                color += throughput * emissive_color;
-            break;
-        }
+            // glass material
+            if (rec.mat->type(emissive_color) == Material::GLASS) {
+                start_dimension(kScatterDimension);
+                rec.mat->scatter(wo, rec, wi);
+                throughput *= rec.mat->bsdf(wo, wi, rec);
+                ray = Ray(rec.p, wi);
+                continue;
+            }
 
-        // glass material
-        if (rec.mat->type(emissive_color) == Material::GLASS) {
-            rec.mat->scatter(wo, rec, wi);
-            throughput *= rec.mat->bsdf(wo, wi, rec);
-            ray = Ray(rec.p, wi);
-            continue;
+            rec.normal = glm::dot(rec.normal, wo) > 0 ? rec.normal : -rec.normal;
+
+            // Light reaching the first diffuse vertex through glass can only be found by the photons
+            if (emissive_flag && options.caustic_photons > 0)
+                color += throughput * caustics.estimate(rec, wo);
+            bool secondary = !emissive_flag;
+            emissive_flag = false;
+
+            DTreeWrapper* dtree = options.guiding ? guide.lookup(rec.p) : NULL;
+            int cache_cell = (options.radiance_cache || options.adaptive_rr) ? cache.cell(rec) : -1;
+
+            // The direct light of the primary hit may already be resampled
+            if (bounce == 0 && primary_direct) {
+                add_contribution(*primary_direct);
+            } else {
+                int num_nee = secondary ? 1 : options.primary_nee;
+                vec3 direct(0.0f);
+                start_dimension(kLightDimension);
+                for (int i = 0; i < num_nee; i++)
+                    direct += sample_light(rec, wo, world, dtree);
+                add_contribution(throughput * direct / static_cast<flt>(num_nee));
+                path_stats.light_samples += num_nee;
+            }
+
+            // Secondary diffuse vertices stop at a converged cache cell
+            if (options.radiance_cache && secondary && cache_cell >= 0 && cache.converged(cache_cell)) {
+                add_contribution(throughput * rec.mat->albedo(rec) / PI * cache.irradiance(cache_cell));
+                break;
+            }
+            if (max_depth > 0 && bounce + 1 >= max_depth)
+                break;
+
+            // Number of continuations, either fixed at the first diffuse vertex or from the
+            // weight window of the expected contribution relative to the pixel estimate
+            int num_split = 1;
+            bool roulette = true;
+            if (!secondary && options.primary_split > 1) {
+                num_split = options.primary_split;
+                roulette = false;
+            } else if (options.adaptive_rr && cache_cell >= 0 && pixel_estimate > 0
+                && cache.samples(cache_cell) >= kAdaptiveMinSamples) {
+                roulette = false;
+                flt ratio = luminance(throughput * rec.mat->albedo(rec) / PI * cache.irradiance(cache_cell)) / pixel_estimate;
+                flt lower = 2.0f / (1.0f + kWeightWindow);
+                if (ratio < lower) {
+                    flt survival = std::max(ratio / lower, kMinSurvival);
+                    start_dimension(kSurvivalDimension);
+                    if (uniform() >= survival) {
+                        path_stats.kills++;
+                        break;
+                    }
+                    throughput /= survival;
+                } else if (ratio > kWeightWindow * lower) {
+                    num_split = std::min(static_cast<int>(ceilf(ratio / (kWeightWindow * lower))), kMaxSplit);
+                }
+            }
+            num_split = std::min(num_split, kMaxPathBranches - num_branches);
+
+            int first_branch = num_branches;
+            for (int i = 0; i < num_split; i++) {
+                start_dimension(kScatterDimension);
+                flt pdf = scatter(wo, rec, wi, dtree);
+                if (!(glm::dot(wi, rec.normal) > 0 && pdf > 0.0f)) {
+                    // throughput will be all zero
+                    continue;
+                }
+                PathBranch& branch = branches[num_branches];
+                branch.throughput = throughput * rec.mat->bsdf(wo, wi, rec) * glm::dot(wi, rec.normal) / (pdf * num_split);
+
+                if (roulette && bounce >= kRouletteBounce) {
+                    start_dimension(kRouletteDimension);
+                    if (uniform() < glm::compMax(branch.throughput)) {
+                        branch.throughput /= glm::compMax(branch.throughput);
+                    } else {
+                        path_stats.kills++;
+                        continue;
+                    }
+                }
+
+                branch.ray = Ray(rec.p, wi);
+                branch.bounce = bounce + 1;
+                branch.num_vertices = num_vertices;
+                branch.num_cache_vertices = num_cache_vertices;
+                branch.has_vertex = dtree && guide.training && num_vertices < kMaxGuideVertices;
+                if (branch.has_vertex) {
+                    GuideVertex vertex = { dtree, wi, branch.throughput, vec3(0.0f), pdf };
+                    branch.vertex = vertex;
+                }
+                branch.has_cache_vertex = cache_cell >= 0 && num_cache_vertices < kMaxCacheVertices;
+                if (branch.has_cache_vertex) {
+                    CacheVertex vertex = { cache_cell, branch.throughput, vec3(0.0f), glm::dot(wi, rec.normal) / pdf };
+                    branch.cache_vertex = vertex;
+                }
+                num_branches++;
+            }
+            if (num_branches == first_branch)
+                break;
+            path_stats.splits += num_branches - first_branch - 1;
+            start_branch(branches[--num_branches]);
         }
 
+        if (num_branches == 0)
+            break;
+        // Vertices past the split point belong to the finished branch
+        const PathBranch& branch = branches[--num_branches];
+        while (num_vertices > branch.num_vertices)
+            vertices[--num_vertices].commit();
+        while (num_cache_vertices > branch.num_cache_vertices)
+            cache_vertices[--num_cache_vertices].commit(cache);
+        bounce = branch.bounce;
         emissive_flag = false;
-        rec.normal = glm::dot(rec.normal, wo) > 0 ? rec.normal : -rec.normal;
+        start_branch(branch);
+    }
 
-        color += throughput * sample_light(rec, wo, world);
-        flt pdf = rec.mat->scatter(wo, rec, wi);
-        if (glm::dot(wi, rec.normal) > 0 && pdf > 0.0f) {
-            ray = Ray(rec.p, wi);
-            throughput *= rec.mat->bsdf(wo, wi, rec) * glm::dot(wi, rec.normal) / pdf;
-        } else {
-            // throughput will be all zero, stop
-            break;
+    for (int i = 0; i < num_vertices; i++)
+        vertices[i].commit();
+    for (int i = 0; i < num_cache_vertices; i++)
+        cache_vertices[i].commit(cache);
+    thread_stats[omp_get_thread_num()].stats.add(path_stats);
+    return color;
+}
+
+void Scene::render_sample(int now_sample)
+{
+    integrator->render_sample(*this, now_sample);
+}
+
+// Train the guiding distribution with passes of 1, 2, 4, ... samples per pixel,
+// as long as the final pass keeps at least twice the samples of the last one.
+// The training images are discarded. Returns the number of samples used.
+int Scene::train_guide(int num_sample)
+{
+    BBox box;
+    bvh_root->bounding_box(box);
+    guide.init(box);
+
+    int used_sample = 0;
+    for (int pass_sample = 1; used_sample + 3 * pass_sample <= num_sample; pass_sample *= 2) {
+        for (int i = 1; i <= pass_sample; i++) {
+            render_sample(used_sample + i);
         }
+        used_sample += pass_sample;
+        guide.next_iteration();
+        INFO("guiding iteration %d: %d samples\n", guide.iteration, pass_sample);
+    }
 
-        if (bounce >= 3) {
-            if (uniform() < glm::compMax(throughput))
-                throughput /= glm::compMax(throughput);
-            else
-                break;
+    guide.training = false;
+    buffer.clear();
+    return used_sample;
+}
+
+// Snapshot at num_sample samples of dir/name.jpg is dir/{num_sample:04d}name.jpg
+static std::string snapshot_file(const std::string& outfile, int num_sample)
+{
+    size_t slash = outfile.find_last_of('/');
+    size_t start = slash == std::string::npos ? 0 : slash + 1;
+    char prefix[16];
+    snprintf(prefix, sizeof(prefix), "%04d", num_sample);
+    return outfile.substr(0, start) + prefix + outfile.substr(start);
+}
+
+// Denoised image of dir/name.jpg is dir/name_denoised.{format}
+static std::string denoised_file(const std::string& outfile, const std::string& format)
+{
+    return outfile.substr(0, outfile.find_last_of('.')) + "_denoised." + format;
+}
+
+// Checkpoint of dir/name.jpg is dir/name.ckpt
+static std::string checkpoint_file(const std::string& outfile)
+{
+    return outfile.substr(0, outfile.find_last_of('.')) + ".ckpt";
+}
+
+// Stripes of rows of the image take all their samples one after another and go
+// straight to the mapped image files, only one stripe is in memory
+void Scene::render_stripes(const std::string& outfile, int num_sample)
+{
+    reset_stats();
+    INFO("Begin render images\n");
+    integrator = create_integrator(options);
+    first_sample = 1;
+    auto init_stripe = [&](int y0, int rows) {
+        buffer.init(camera.width, rows);
+        buffer.y0 = y0;
+        buffer.track_samples();
+        features = FeatureChannels();
+        if (options.aov)
+            features.add_to(buffer);
+    };
+
+    init_stripe(0, 1);
+    size_t row_bytes = 0;
+    for (int c = 0; c < buffer.num_channels(); c++)
+        row_bytes += buffer.stride(c) * sizeof(flt);
+    int rows = std::min(static_cast<double>(camera.height), options.memory_budget * (1 << 20) / static_cast<double>(row_bytes));
+    if (options.tile_size > 0 && rows > options.tile_size)
+        rows -= rows % options.tile_size;
+    rows = std::max(rows, 1);
+    INFO("Stripes of %d rows, %.1f MB\n", rows, static_cast<double>(rows) * row_bytes / (1 << 20));
+
+    std::vector<MappedImage> images(options.formats.size());
+    for (int i = 0; i < static_cast<int>(images.size()); i++) {
+        std::string file = with_extension(outfile, options.formats[i]);
+        if (!images[i].open(file, camera.width, camera.height, buffer))
+            ERRORM("Cannot create %s\n", file.c_str());
+    }
+    for (int y0 = 0; y0 < camera.height; y0 += rows) {
+        // Every stripe starts from fresh caustic radii and caches, as the whole image would
+        init_stripe(y0, std::min(rows, camera.height - y0));
+        integrator->init(*this);
+        integrator->render_samples(*this, 1, num_sample);
+        collect_stats();
+        for (int i = 0; i < static_cast<int>(images.size()); i++) {
+            if (!images[i].write_rows(buffer, y0, num_sample))
+                ERRORM("Cannot write rows %d to %d of the image\n", y0, y0 + buffer.height - 1);
         }
+        INFO("rows %d to %d of %d\n", y0, y0 + buffer.height - 1, camera.height);
+    }
+    for (auto& image : images)
+        image.close();
+
+    INFO("End render images\n");
+    stats.report();
+}
+
+void Scene::reset_stats()
+{
+    stats.reset();
+    thread_stats.assign(omp_get_max_threads(), ThreadPathStats());
+}
+
+void Scene::collect_stats()
+{
+    for (auto& thread : thread_stats) {
+        stats.add(thread.stats);
+        thread.stats.reset();
     }
-    return color;
+}
+
+bool Scene::out_of_time() const
+{
+    return options.time_budget > 0 && std::chrono::steady_clock::now() >= deadline;
 }
 
 void Scene::render(const std::string& outfile, int num_sample)
 {
-    buffer.clear();
+    if (options.memory_budget > 0) {
+        render_stripes(outfile, num_sample);
+        return;
+    }
+    // Laid out again, a worker renders several parts with one scene. The guide
+    // is trained from sample 1, whatever part came before.
+    first_sample = 1;
+    const std::vector<int>& crop = options.crop;
+    if (crop.empty()) {
+        buffer.init(camera.width, camera.height);
+    } else {
+        if (crop[2] > camera.width || crop[3] > camera.height)
+            ERRORM("--crop %d,%d,%d,%d is outside the %d x %d image\n", crop[0], crop[1], crop[2], crop[3], camera.width, camera.height);
+        buffer.init(crop[2] - crop[0], crop[3] - crop[1]);
+        buffer.x0 = crop[0];
+        buffer.y0 = crop[1];
+    }
+    reset_stats();
     INFO("Begin render images\n");
-    for (int now_sample = 1; now_sample <= num_sample; now_sample++) {
-#pragma omp parallel for schedule(dynamic)
-        for (int x_t = 0; x_t < buffer.width; x_t++) {
-            for (int y_t = 0; y_t < buffer.height; y_t++) {
-                vec3 light = Li(camera.cast_ray(x_t, y_t), bvh_root);
-
-                if (std::isfinite(light[0]) && std::isfinite(light[1]) && std::isfinite(light[2])) {
-                    buffer.b_array[y_t][x_t] += light;
-                } else {
-                    DEBUGM("Not finite number at sample %d x %d y %d\n", now_sample, x_t, y_t);
-                }
-            }
+    deadline = std::chrono::steady_clock::now()
+        + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(options.time_budget));
+    integrator = create_integrator(options);
+    // Pixel integrators may stop in the middle of a pass, their pixels are normalized by their own sample counts
+    if (dynamic_cast<PixelIntegrator*>(integrator.get()))
+        buffer.track_samples();
+    features = FeatureChannels();
+    if (options.aov)
+        features.add_to(buffer);
+    integrator->init(*this);
+    if (options.guiding) {
+        num_sample -= train_guide(num_sample);
+    }
+    // A part of a distributed render only writes its partial buffer
+    bool partial = options.parts > 1;
+    if (partial) {
+        part_samples(options.part, options.parts, num_sample, first_sample, num_sample);
+        INFO("Part %d of %d: samples %d to %d\n", options.part, options.parts, first_sample, num_sample);
+    }
+    std::string ckpt = partial ? partial_file(outfile, options.part) : checkpoint_file(outfile);
+
+    // Learned state such as the guide or the caches is learned again on resume,
+    // only the framebuffer and the sample counts are restored
+    CheckpointInfo info;
+    info.integrator = options.integrator;
+    info.sampler = options.sampler;
+    info.blue_noise = options.blue_noise;
+    info.first = first_sample;
+    info.part = options.part;
+    info.parts = options.parts;
+    int rendered = first_sample - 1;
+    if (options.resume) {
+        CheckpointInfo saved;
+        if (!load_checkpoint(ckpt, buffer, saved))
+            ERRORM("Cannot resume from %s, it is missing or of another image size or integrator\n", ckpt.c_str());
+        if (saved.integrator != info.integrator || saved.sampler != info.sampler || saved.blue_noise != info.blue_noise)
+            ERRORM("%s was rendered by the %s integrator and the %s sampler%s\n", ckpt.c_str(),
+                saved.integrator.c_str(), saved.sampler.c_str(), saved.blue_noise ? " with --blue-noise" : "");
+        if (saved.first != info.first || saved.part != info.part || saved.parts != info.parts)
+            ERRORM("%s starts at sample %d, not %d\n", ckpt.c_str(), saved.first, info.first);
+        rendered = saved.rendered;
+        INFO("Resume at sample num: %d\n", rendered);
+    }
+
+    // Samples between two output images are rendered together, the images are
+    // written in the background while rendering goes on
+    ImageWriter writer;
+    auto write_images = [&](const std::string& file, int sample_num, bool progress) {
+        for (auto& format : options.formats)
+            writer.write(buffer, with_extension(file, format), sample_num, progress);
+    };
+    size_t next_snapshot = std::upper_bound(options.snapshots.begin(), options.snapshots.end(), rendered) - options.snapshots.begin();
+    std::chrono::steady_clock::time_point last_checkpoint = std::chrono::steady_clock::now();
+    for (int now_sample = rendered + 1; now_sample <= num_sample;) {
+        int last = std::min(now_sample - 1 + kProgressInterval - (now_sample - 1) % kProgressInterval, num_sample);
+        if (next_snapshot < options.snapshots.size())
+            last = std::min(last, options.snapshots[next_snapshot]);
+        rendered = now_sample - 1 + integrator->render_samples(*this, now_sample, last - now_sample + 1);
+        collect_stats();
+        if (rendered < last) {
+            INFO("Time budget spent at sample num: %d\n", rendered);
+            break;
+        }
+        now_sample = last + 1;
+
+        if (next_snapshot < options.snapshots.size() && last == options.snapshots[next_snapshot]) {
+            INFO("snapshot at sample num: %d\n", last);
+            write_images(snapshot_file(outfile, last), last, false);
+            next_snapshot++;
+        }
+        if (last % kProgressInterval == 0) {
+            INFO("sample num: %d\n", last);
+            if (!partial)
+                write_images(outfile, last - first_sample + 1, true);
         }
-        if (now_sample % 5 == 0) {
-            INFO("sample num: %d\n", now_sample);
-            buffer.to_picture(outfile, now_sample);
+        if (options.checkpoint_interval > 0 && now_sample <= num_sample
+            && std::chrono::steady_clock::now() - last_checkpoint >= std::chrono::duration<double>(options.checkpoint_interval)) {
+            info.rendered = last;
+            writer.checkpoint(buffer, ckpt, info);
+            last_checkpoint = std::chrono::steady_clock::now();
+        }
+        if (now_sample <= num_sample && out_of_time()) {
+            INFO("Time budget spent at sample num: %d\n", rendered);
+            break;
         }
     }
+    for (; next_snapshot < options.snapshots.size(); next_snapshot++)
+        INFO("Snapshot at %d samples skipped, only %d samples are rendered\n", options.snapshots[next_snapshot], rendered);
 
     INFO("End render images\n");
-    buffer.to_picture(outfile, num_sample);
-}
\ No newline at end of file
+    stats.report();
+    if (buffer.tracks_samples()) {
+        flt min_samples = INFINITY, max_samples = 0, sum = 0;
+        for (int y_t = 0; y_t < buffer.height; y_t++) {
+            for (int x_t = 0; x_t < buffer.width; x_t++) {
+                flt n = buffer.samples(x_t, y_t);
+                min_samples = std::min(min_samples, n);
+                max_samples = std::max(max_samples, n);
+                sum += n;
+            }
+        }
+        INFO("samples per pixel: min %.0f max %.0f mean %.2f\n", min_samples, max_samples, sum / (buffer.width * buffer.height));
+        // Tiles skipped at the deadline leave pixels behind the last sample number
+        info.rendered = first_sample - 1 + min_samples;
+    } else {
+        info.rendered = rendered;
+    }
+    if (!partial)
+        write_images(outfile, rendered - first_sample + 1, false);
+    // A crop is kept to be pasted into the linear buffer of a whole render
+    if (partial || !crop.empty() || options.checkpoint_interval > 0)
+        writer.checkpoint(buffer, ckpt, info);
+    if (options.denoise && !partial) {
+        INFO("Begin denoise\n");
+        Buffer denoised;
+        denoise(buffer, features, denoised);
+        for (auto& format : options.formats)
+            writer.write(denoised, denoised_file(outfile, format), 1);
+    }
+}
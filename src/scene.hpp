@@ -1,26 +1,70 @@
 #pragma once
 
+#include <chrono>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "bvh.hpp"
 #include "camera.hpp"
+#include "envmap.hpp"
 #include "global.hpp"
+#include "guiding.hpp"
+#include "light_cache.hpp"
+#include "lights.hpp"
+#include "integrator.hpp"
 #include "material.hpp"
 #include "object.hpp"
 #include "ray.hpp"
+#include "options.hpp"
+#include "photon.hpp"
+#include "radiance_cache.hpp"
+#include "restir.hpp"
 #include "tiny_obj_loader.h"
 #include "buffer.hpp"
+#include "denoiser.hpp"
+
+// Counters of the path tracer over a render
+struct PathStats {
+    long long paths;
+    long long rays;
+    long long light_samples;
+    long long splits;
+    long long kills;
+
+    void reset();
+    void add(const PathStats& other);
+    void report() const;
+};
+
+// Counters of one thread, the padding keeps the threads off each other's cache lines
+struct ThreadPathStats {
+    PathStats stats;
+    // Counted by every thread on its own in Li, collected into stats
+    std::vector<ThreadPathStats> thread_stats;
+    char padding[64];
+};
 
 class Scene {
 public:
     Scene();
     Scene(const std::string& objdir, const std::string& objname);
     void render(const std::string& outfile, int num_sample = 30);
+    // render within the --memory budget
+    void render_stripes(const std::string& outfile, int num_sample);
+    void render_sample(int now_sample);
+    int train_guide(int num_sample);
+    // Whether the --time budget of the render is spent
+    bool out_of_time() const;
+    // Zero the counters, and add those of the threads to stats after a batch of samples
+    void reset_stats();
+    void collect_stats();
     bool hit(const Ray& ray, const vec2& t_range, HitRecord& rec);
 
-    vec3 Li(const Ray& ray, const Hittable* world);
-    vec3 sample_light(const HitRecord& rec, const vec3& wo, const Hittable* world);
+    vec3 Li(const Ray& ray, const Hittable* world, const vec3* primary_direct = NULL, flt pixel_estimate = 0);
+    vec3 sample_light(const HitRecord& rec, const vec3& wo, const Hittable* world, const DTreeWrapper* dtree = NULL);
+    flt scatter(const vec3& wo, const HitRecord& rec, vec3& wi, const DTreeWrapper* dtree);
+    flt scatter_pdf(const vec3& wo, const HitRecord& rec, const vec3& wi, const DTreeWrapper* dtree);
 
 public:
     std::vector<Hittable*> objects;
@@ -29,6 +73,37 @@ public:
     Buffer buffer;
     Hittable* bvh_root;
 
+    RenderOptions options;
+    PathStats stats;
+    // Counted by every thread on its own in Li, collected into stats
+    std::vector<ThreadPathStats> thread_stats;
+    // End of the --time budget
+    std::chrono::steady_clock::time_point deadline;
+    // AOV channels of the framebuffer, filled by the pixel integrators
+    FeatureChannels features;
+    // First sample number of the render, above 1 for the later parts of a distributed render
+    int first_sample;
+
     // For light sampling
     EmissiveGroup egroup;
+
+    // For path guiding
+    PathGuide guide;
+
+    // For caustics through glass
+    CausticMap caustics;
+
+    // For cached diffuse interreflections
+    RadianceCache cache;
+
+    // For resampled direct light at the primary hits
+    ReSTIR restir;
+
+    // For light selection learned per region of the scene
+    LightCache light_cache;
+
+    // Selected with --integrator, created by render
+    std::unique_ptr<Integrator> integrator;
+    // Vertices after which Li stops, 0 for unlimited
+    int max_depth;
 };
\ No newline at end of file
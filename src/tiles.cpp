@@ -0,0 +1,73 @@
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "global.hpp"
+#include "tiles.hpp"
+
+// Position of the d-th cell along the Hilbert curve filling an n x n grid, n a power of two
+static ivec2 hilbert_cell(int n, int d)
+{
+    int x = 0, y = 0;
+    for (int s = 1; s < n; s *= 2) {
+        int rx = 1 & (d / 2);
+        int ry = 1 & (d ^ rx);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+        x += s * rx;
+        y += s * ry;
+        d /= 4;
+    }
+    return ivec2(x, y);
+}
+
+TileScheduler::TileScheduler(int width, int height, int tile_size, int num_threads)
+    : queues(std::max(num_threads, 1))
+    , locks(std::max(num_threads, 1))
+{
+    int tiles_x = (width + tile_size - 1) / tile_size;
+    int tiles_y = (height + tile_size - 1) / tile_size;
+    int n = 1;
+    while (n < tiles_x || n < tiles_y)
+        n *= 2;
+    for (int d = 0; d < n * n; d++) {
+        ivec2 cell = hilbert_cell(n, d);
+        if (cell[0] >= tiles_x || cell[1] >= tiles_y)
+            continue;
+        Tile tile = { cell[0] * tile_size, cell[1] * tile_size,
+            std::min((cell[0] + 1) * tile_size, width), std::min((cell[1] + 1) * tile_size, height) };
+        tiles.push_back(tile);
+    }
+
+    int num_queue = queues.size();
+    for (int i = 0; i < static_cast<int>(tiles.size()); i++)
+        queues[static_cast<long long>(i) * num_queue / tiles.size()].push_back(i);
+}
+
+bool TileScheduler::next(int thread, Tile& tile)
+{
+    int num_queue = queues.size();
+    for (int k = 0; k < num_queue; k++) {
+        int victim = (thread + k) % num_queue;
+        std::lock_guard<std::mutex> lock(locks[victim]);
+        std::deque<int>& queue = queues[victim];
+        if (queue.empty())
+            continue;
+        if (k == 0) {
+            tile = tiles[queue.front()];
+            queue.pop_front();
+        } else {
+            tile = tiles[queue.back()];
+            queue.pop_back();
+        }
+        return true;
+    }
+    return false;
+}
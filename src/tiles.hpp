@@ -0,0 +1,29 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "global.hpp"
+
+// Pixels [x0, x1) x [y0, y1) of the image
+struct Tile {
+    int x0, y0, x1, y1;
+};
+
+// Tiles of the image along a Hilbert curve, shared out by work stealing. Every thread
+// starts with a contiguous run of the curve and takes from its front, idle threads
+// steal from the back of the others, so neighbouring tiles stay on the same thread.
+class TileScheduler {
+public:
+    TileScheduler(int width, int height, int tile_size, int num_threads);
+    // False once all the tiles are taken
+    bool next(int thread, Tile& tile);
+
+public:
+    std::vector<Tile> tiles;
+
+private:
+    std::vector<std::deque<int>> queues;
+    std::vector<std::mutex> locks;
+};